@@ -19,16 +19,68 @@
 
 /* Some common functions */
 int read_half(struct segment* f, char* failure);
-int read_word(struct segment* f, char* failure);
-int read_double(struct segment* f, char* failure);
+SCM read_word(struct segment* f, char* failure);
+SCM read_double(struct segment* f, char* failure);
 SCM read_register(struct segment* f, char* failure);
-char* read_string(struct segment* f, int base, int offset, char* error);
+char* read_string(struct segment* f, SCM base, SCM offset, char* error);
 int get_char(struct segment* f);
 void put_char(int c, struct segment* f);
 void write_half(struct segment* f, int o);
-void write_word(struct segment* f, int o);
-void write_double(struct segment* f, int o);
-struct segment* output_buffer_generate();
+void write_word(struct segment* f, SCM o);
+void write_double(struct segment* f, SCM o);
+struct segment* output_file_map(FILE* f, SCM size);
+SCM output_header_size();
+int output_program_header_count();
+SCM output_program_headers_end();
+SCM build_id_note_size();
+void write_build_id_note(struct segment* f, SCM offset);
+struct segment* generate_output_strtab(struct symbol* table);
+struct segment* generate_output_symtab(struct symbol* table, struct output_section* sections);
+struct segment* generate_output_symtab_shndx(struct symbol* table, struct output_section* sections);
+struct segment* generate_section_name_table(struct output_section* sections);
+SCM count_local_symbols(struct symbol* table);
+SCM symbol_entry_size();
+struct symbol* find_global_symbol(char* name);
+void publish_symbol(struct symbol* s);
+void write_register(struct segment* f, SCM o);
+struct relocation_type* lookup_relocation_type(SCM type);
+SCM got_entry_offset(struct elf_object_file* f, struct elf_symbol* sym);
+int segment_rank(struct output_section* o);
+SCM layout_output_section(struct output_section* o, SCM address);
+void reorder_output_pieces(struct output_section* o, struct placement* p);
+void fill_code_gap(struct segment* f, SCM offset, SCM size);
+struct output_section* find_output_section(char* name);
+struct output_section* new_output_section(char* name, int type, SCM flags);
+struct elf_section_header* find_section_by_number(struct elf_object_file* f, int number);
+SCM string_length(char* s);
+
+int has_prefix(char* s, char* prefix)
+{
+	int i = 0;
+	while(0 != prefix[i])
+	{
+		if(s[i] != prefix[i]) return FALSE;
+		i = i + 1;
+	}
+	return TRUE;
+}
+
+void read_extended_numbering(struct segment* f, struct elf_header* e)
+{
+	/* Past 0xFF00 sections the real counts are kept in section header 0 */
+	if(0 == e->e_shoff) return;
+	if((0 != e->e_shnum) && (SHN_XINDEX != e->e_shstrndx)) return;
+
+	/* sh_size follows sh_name, sh_type, sh_flags, sh_addr and sh_offset, then sh_link */
+	SCM hold = read_offset;
+	if(largeint) read_offset = e->e_shoff + 32;
+	else read_offset = e->e_shoff + 20;
+	SCM size = read_register(f, "Hit EOF while attempting to read the section count\n");
+	SCM link = read_word(f, "Hit EOF while attempting to read the section name table index\n");
+	if(0 == e->e_shnum) e->e_shnum = size;
+	if(SHN_XINDEX == e->e_shstrndx) e->e_shstrndx = link;
+	read_offset = hold;
+}
 
 struct elf_header* read_elf_header(struct segment* f)
 {
@@ -112,6 +164,7 @@ struct elf_header* read_elf_header(struct segment* f)
 	r->e_shentsize = read_half(f, "Hit EOF while attempting to read e_shentsize\n");
 	r->e_shnum = read_half(f, "Hit EOF while attempting to read e_shnum\n");
 	r->e_shstrndx = read_half(f, "Hit EOF while attempting to read e_shstrndx\n");
+	read_extended_numbering(f, r);
 	require(r->e_shstrndx <= r->e_shnum, "Index of the section header table entry exceeds number of section entries\n");
 
 	return r;
@@ -149,6 +202,7 @@ struct elf_section_header* read_section_header(struct segment* f, struct elf_hea
 	struct elf_section_header* hold = NULL;
 	int i;
 	SCM offset_of_strings = 0;
+	current_file->section_index = calloc(e->e_shnum, sizeof(struct elf_section_header*));
 	read_offset = e->e_shoff;
 	for(i = 0; i < e->e_shnum; i = i + 1)
 	{
@@ -165,6 +219,8 @@ struct elf_section_header* read_section_header(struct segment* f, struct elf_hea
 		r->sh_addralign = read_register(f, "Hit EOF while attempting to read sh_addralign\n");
 		r->sh_entsize = read_register(f, "Hit EOF while attempting to read sh_entsize\n");
 		r->section_number = i;
+		r->file = current_file;
+		current_file->section_index[i] = r;
 		hold = r;
 		if(i == e->e_shstrndx) offset_of_strings = r->sh_offset;
 	}
@@ -172,35 +228,60 @@ struct elf_section_header* read_section_header(struct segment* f, struct elf_hea
 	while(NULL != hold)
 	{
 		hold->sh_name = read_string(f, offset_of_strings, hold->sh_name_offset, "Hit EOF while attempting to read sh_name string\n");
-		if(match(".strtab", hold->sh_name)) current_file->string_table = hold;
-		else if(match(".symtab", hold->sh_name)) current_file->symbol_table = hold;
-		else if(match(".text", hold->sh_name)) current_file->text = hold;
-		else if(match(".data", hold->sh_name)) current_file->data = hold;
-		else if(match(".bss", hold->sh_name)) current_file->bss = hold;
-		else if(match(".rel.text", hold->sh_name)) current_file->_rel_text = hold;
-		else if(match(".rela.text", hold->sh_name)) current_file->_rela_text = hold;
-		else if(match(".rel.data", hold->sh_name)) current_file->_rel_data = hold;
-		else if(match(".rela.data", hold->sh_name)) current_file->_rela_data = hold;
+		/* SHT_SYMTAB, which names its string table in sh_link */
+		if(2 == hold->sh_type) current_file->symbol_table = hold;
 		hold = hold->next;
 	}
 
+	/* Everything else is classified when sections are mapped to the output */
+	require(NULL != current_file->symbol_table, "Input file has no symbol table\n");
+	for(hold = r; NULL != hold; hold = hold->next)
+	{
+		if(hold->section_number == current_file->symbol_table->sh_link) current_file->string_table = hold;
+		/* SHT_SYMTAB_SHNDX, the st_shndx of symbols past SHN_LORESERVE */
+		if((18 == hold->sh_type) && (hold->sh_link == current_file->symbol_table->section_number)) current_file->symbol_index_table = hold;
+	}
+	require(NULL != current_file->string_table, "Symbol table has no string table\n");
+
 	return r;
 }
 
+int read_symbol_section(struct segment* f, SCM shndx, SCM number)
+{
+	if(SHN_XINDEX == shndx)
+	{
+		/* The real section number is the symbol's entry in SHT_SYMTAB_SHNDX */
+		require(NULL != current_file->symbol_index_table, "Symbol uses SHN_XINDEX without a SHT_SYMTAB_SHNDX section\n");
+		SCM hold = read_offset;
+		read_offset = current_file->symbol_index_table->sh_offset + (number * 4);
+		shndx = read_word(f, "Hit EOF while attempting to read an extended st_shndx\n");
+		read_offset = hold;
+		return shndx;
+	}
+
+	/* SHN_ABS, SHN_COMMON and the rest of the reserved range */
+	if(SHN_LORESERVE <= shndx) return shndx - 0x10000;
+	return shndx;
+}
+
 struct elf_symbol* read_symbols(struct segment* f)
 {
 	struct elf_symbol* r = NULL;
 	struct elf_symbol* hold = NULL;
 	read_offset = current_file->symbol_table->sh_offset;
-	int i = 0;
-	int count = current_file->symbol_table->sh_size / current_file->symbol_table->sh_entsize;
-	if(current_file->symbol_table->sh_info != count)
+	SCM i = 0;
+	SCM count = current_file->symbol_table->sh_size / current_file->symbol_table->sh_entsize;
+	/* sh_info is one past the last local symbol, so it can not be past the end */
+	if(current_file->symbol_table->sh_info > count)
 	{
-		file_print("\nWARNING: sh_info in the symbol table does not match number of entries\nPossible bug in assmbler/compiler that generated: ", stderr);
+		file_print("\nWARNING: sh_info in the symbol table is past the last entry\nPossible bug in assmbler/compiler that generated: ", stderr);
 		file_print(current_file->name, stderr);
 		file_print("\nPlease take note\n\n", stderr);
 	}
 
+	/* Relocations name their symbol by number */
+	current_file->symbol_count = count;
+	current_file->symbol_index = calloc(count + 1, sizeof(struct elf_symbol*));
 	while(i < count)
 	{
 		r = calloc(1, sizeof(struct elf_symbol));
@@ -212,7 +293,7 @@ struct elf_symbol* read_symbols(struct segment* f)
 			require(EOF != r->st_info, "Hit EOF while attempting to read st_info\n");
 			r->st_other = get_char(f);
 			require(EOF != r->st_other, "Hit EOF while attempting to read st_other\n");
-			r->st_shndx = read_half(f, "Hit EOF while attempting to read \n");
+			r->st_shndx = read_symbol_section(f, read_half(f, "Hit EOF while attempting to read \n"), i);
 			r->st_value = read_register(f, "Hit EOF while attempting to read st_value\n");
 			r->st_size = read_register(f, "Hit EOF while attempting to read st_size\n");
 		}
@@ -224,9 +305,10 @@ struct elf_symbol* read_symbols(struct segment* f)
 			require(EOF != r->st_info, "Hit EOF while attempting to read st_info\n");
 			r->st_other = get_char(f);
 			require(EOF != r->st_other, "Hit EOF while attempting to read st_other\n");
-			r->st_shndx = read_half(f, "Hit EOF while attempting to read \n");
+			r->st_shndx = read_symbol_section(f, read_half(f, "Hit EOF while attempting to read \n"), i);
 		}
 		r->symbol_number = i;
+		current_file->symbol_index[i] = r;
 		hold = r;
 		i = i + 1;
 	}
@@ -240,62 +322,46 @@ struct elf_symbol* read_symbols(struct segment* f)
 	return r;
 }
 
-char* find_relocation_symbol_name(SCM index)
+struct elf_symbol* find_relocation_symbol(SCM index)
 {
-	struct elf_symbol* i = current_file->symbols;
-	while(NULL != i)
-	{
-		if(index == i->symbol_number)
-		{
-			/* first deal with happy case */
-			if(!match("", i->st_name)) return i->st_name;
-
-			/* deal with the case of a shit assembler */
-			struct elf_section_header* sections = current_file->sections;
-			while(NULL != sections)
-			{
-				if(i->st_shndx == sections->section_number) return sections->sh_name;
+	if((0 <= index) && (index < current_file->symbol_count)) return current_file->symbol_index[index];
 
-				sections = sections->next;
-			}
+	file_print("Relocation refers to a symbol that does not exist in: ", stderr);
+	file_print(current_file->name, stderr);
+	file_print("\nAborting to prevent issues\n", stderr);
+	exit(EXIT_FAILURE);
+}
 
-			file_print("Giving up figuring out symbol\n", stderr);
-			exit(EXIT_FAILURE);
-		}
+char* find_relocation_symbol_name(struct elf_symbol* i)
+{
+	/* first deal with happy case */
+	if(!match("", i->st_name)) return i->st_name;
 
-		i = i->next;
-	}
+	/* deal with the case of a shit assembler */
+	struct elf_section_header* s = find_section_by_number(current_file, i->st_shndx);
+	if(NULL != s) return s->sh_name;
 
-	return NULL;
+	file_print("Giving up figuring out symbol\n", stderr);
+	exit(EXIT_FAILURE);
 }
 
-struct elf_relocation* read_relocation(struct segment* f, char* segment)
+struct elf_relocation* read_relocation_entries(struct segment* f, struct elf_section_header* s)
 {
-	struct elf_section_header* s = NULL;
-	if(match(".data", segment))
-	{
-		s = current_file->_rel_data;
-	}
-	else if(match(".text", segment))
-	{
-		s = current_file->_rel_text;
-	}
-	else require(NULL != s, "read_relocation called withour valid section argument\n");
-
 	if(NULL == s) return NULL;
 
-	int count = s->sh_size / s->sh_entsize;
+	SCM count = s->sh_size / s->sh_entsize;
 	struct elf_relocation* r = NULL;
 	struct elf_relocation* hold = NULL;
 	read_offset = s->sh_offset;
-	int i = 0;
+	SCM i = 0;
 	while(i < count)
 	{
 		r = calloc(1, sizeof(struct elf_relocation));
 		r->next = hold;
 		r->r_offset = read_register(f, "Hit EOF while attempting to read r_offset\n");
 		r->r_info = read_register(f, "Hit EOF while attempting to read r_info\n");
-		r->name = find_relocation_symbol_name(r->r_info >> 8);
+		r->symbol = find_relocation_symbol(r->r_info >> 8);
+		r->name = find_relocation_symbol_name(r->symbol);
 		r->r_type = r->r_info & 0xFF;
 
 		r->relocation_number = i;
@@ -306,30 +372,15 @@ struct elf_relocation* read_relocation(struct segment* f, char* segment)
 	return r;
 }
 
-struct elf_adjusted_relocation* read_adjusted_relocations(struct segment* f, char* segment)
+struct elf_adjusted_relocation* read_adjusted_relocation_entries(struct segment* f, struct elf_section_header* s)
 {
-	struct elf_section_header* s = NULL;
-	if(match(".data", segment))
-	{
-		s = current_file->_rela_data;
-	}
-	else if(match(".text", segment))
-	{
-		s = current_file->_rela_text;
-	}
-	else
-	{
-		file_print("read_relocation called withour valid section argument\n", stderr);
-		exit(EXIT_FAILURE);
-	}
-
 	if(NULL == s) return NULL;
 
-	int count = s->sh_size / s->sh_entsize;
+	SCM count = s->sh_size / s->sh_entsize;
 	struct elf_adjusted_relocation* r = NULL;
 	struct elf_adjusted_relocation* hold = NULL;
 	read_offset = s->sh_offset;
-	int i = 0;
+	SCM i = 0;
 	while(i < count)
 	{
 		r = calloc(1, sizeof(struct elf_adjusted_relocation));
@@ -339,7 +390,8 @@ struct elf_adjusted_relocation* read_adjusted_relocations(struct segment* f, cha
 		r->r_info = read_word(f, "Hit EOF while attempting to read r_info\n");
 		if(!BigEndian && largeint) r->r_info_top = read_word(f, "Hit EOF while attempting to read r_info\n");
 		r->r_addend = read_register(f, "Hit EOF while attempting to read r_addend\n");
-		r->name = find_relocation_symbol_name(r->r_info >> 8);
+		r->symbol = find_relocation_symbol(r->r_info >> 8);
+		r->name = find_relocation_symbol_name(r->symbol);
 		r->r_type = r->r_info & 0xFF;
 
 		r->adjusted_relocation_number = i;
@@ -350,61 +402,75 @@ struct elf_adjusted_relocation* read_adjusted_relocations(struct segment* f, cha
 	return r;
 }
 
-struct segment* read_segment(struct segment* f, int offset, int size, char* name)
+struct segment* view_segment(struct segment* f, SCM offset, SCM size, char* name)
 {
-	int i = 0;
-	int c;
+	/* Points straight into the input, nothing is copied */
+	require(offset + size <= f->size, "Section runs past the end of the file\n");
 	struct segment* r = calloc(1, sizeof(struct segment));
 	r->starting_address = -1;
-	r->contents = calloc(size+4, sizeof(char));
+	r->contents = f->contents + offset;
 	r->name = name;
 	r->size = size;
-	read_offset = offset;
-	while(i < size)
-	{
-		c = get_char(f);
-		require(EOF != c, "Hit EOF while attempting to read segment\n");
-		r->contents[i] = c;
-		i = i + 1;
-	}
+	return r;
+}
 
+struct segment* zero_fill_segment(SCM size, char* name)
+{
+	/* Only the address and size are needed, the zeros come from p_memsz */
+	struct segment* r = calloc(1, sizeof(struct segment));
+	r->starting_address = -1;
+	r->contents = NULL;
+	r->name = name;
+	r->size = size;
 	return r;
 }
 
 
-SCM calculate_next_start(struct segment* s, int page_size)
+SCM align_up(SCM address, SCM alignment)
 {
-	/* require sizeof(SCM) of padding after segments because I feel like it */
-	SCM last_address = s->starting_address + s->size + sizeof(SCM);
-	if(0 == (last_address & (page_size - 1))) return last_address;
-	return (last_address & ~(page_size - 1)) + page_size;
+	if(1 >= alignment) return address;
+	return (address + alignment - 1) & ~(alignment - 1);
+}
+
+SCM text_file_offset()
+{
+	return output_header_size();
 }
 
 
 void read_elf_file(struct segment* in)
 {
+	current_file->input = in;
 	current_file->header = read_elf_header(in);
-	current_file->segments = read_program_header(in, current_file->header);
 	current_file->sections = read_section_header(in, current_file->header);
-	current_file->symbols = read_symbols(in);
-	current_file->r_text = read_relocation(in, ".text");
-	current_file->r_data = read_relocation(in, ".data");
-	current_file->ar_text = read_adjusted_relocations(in, ".text");
-	current_file->ar_data = read_adjusted_relocations(in, ".data");
 
-	/* Don't try t read .TEXT if it is not there */
-	if(NULL != current_file->text)
-	{
-		current_file->text->contents = read_segment(in, current_file->text->sh_offset, current_file->text->sh_size, ".text");
-		text_size = text_size + current_file->text->sh_size;
-	}
+	/* Everything else is decoded when it is first needed: symbols when the
+	 * object is mapped, relocations only for sections that are kept and
+	 * contents when they are written */
+}
 
-	/* Don't try t read .DATA if it is not there */
-	if(NULL != current_file->data)
+struct elf_program_header* object_segments(struct elf_object_file* f)
+{
+	/* Relocatable inputs rarely have any, so they are only read if asked for */
+	if((NULL == f->segments) && (0 != f->header->e_phnum))
 	{
-		current_file->data->contents = read_segment(in, current_file->data->sh_offset, current_file->data->sh_size, ".data");
-		data_size = data_size + current_file->data->sh_size;
+		require(NULL != f->input->contents, "Program headers of an object that has been released\n");
+		SCM hold = read_offset;
+		f->segments = read_program_header(f->input, f->header);
+		read_offset = hold;
 	}
+	return f->segments;
+}
+
+void load_object_symbols(struct elf_object_file* f)
+{
+	if(NULL != f->symbols) return;
+
+	/* read_symbols works on current_file */
+	struct elf_object_file* hold = current_file;
+	current_file = f;
+	f->symbols = read_symbols(f->input);
+	current_file = hold;
 }
 
 struct elf_object_file* reverse_nodes(struct elf_object_file* head)
@@ -420,125 +486,239 @@ struct elf_object_file* reverse_nodes(struct elf_object_file* head)
 	return root;
 }
 
-SCM realign_text_segments(struct elf_object_file* h)
+SCM realign_text_segments(struct placement* p)
 {
-	if(NULL == h) return BaseAddress;
-	if(NULL == h->text) return realign_text_segments(h->next);
+	SCM text_start = BaseAddress + output_header_size();
+	SCM next = text_start;
+	struct output_section* o;
+	for(o = output_map; (NULL != o) && (2 > segment_rank(o)); o = o->next)
+	{
+		/* .text pieces go in the order chosen for them */
+		if(match(".text", o->name)) reorder_output_pieces(o, p);
+		next = layout_output_section(o, next);
+		o->offset = o->address - BaseAddress;
+	}
 
-	h->text->contents->starting_address = realign_text_segments(h->next);
-	return h->text->contents->starting_address + h->text->contents->size;
+	text_size = next - text_start;
+	return next;
 }
 
 void realign_data_segments(int page_size)
 {
-	SCM data_start = calculate_next_start(current_file->text->contents, page_size);
-	current_file = reverse_nodes(current_file);
-	struct elf_object_file* h = current_file;
-	while(NULL != h)
+	/* .data follows .text in the file without padding, unless .text is
+	 * being padded out to SegmentAlign for huge pages */
+	data_base_offset = align_up(text_file_offset() + text_size, sizeof(SCM));
+	if(SegmentAlign > page_size) data_base_offset = align_up(data_base_offset, SegmentAlign);
+
+	/* Keep the address congruent to the file offset so the kernel can map it directly */
+	data_base = align_up(BaseAddress + data_base_offset, page_size) + (data_base_offset & (page_size - 1));
+	if(SegmentAlign > page_size) data_base = BaseAddress + data_base_offset;
+
+	SCM next = data_base;
+	struct output_section* o;
+	for(o = output_map; NULL != o; o = o->next)
 	{
-		if(NULL != h->data)
+		if(2 == segment_rank(o))
 		{
-			h->data->contents->starting_address = data_start;
-			data_start = data_start + h->data->contents->size;
+			next = layout_output_section(o, next);
+			o->offset = data_base_offset + o->address - data_base;
 		}
-		h = h->next;
 	}
+	data_size = next - data_base;
+
+	/* .bss follows .data in memory but not in the file */
+	for(o = output_map; NULL != o; o = o->next)
+	{
+		if(3 == segment_rank(o))
+		{
+			next = layout_output_section(o, next);
+			o->offset = data_base_offset + data_size;
+		}
+	}
+	bss_size = next - (data_base + data_size);
 }
 
-SCM lookup_section(char* s, struct elf_section_header* t)
+int symbol_is_local(struct symbol* s)
 {
-	if(NULL == t) return -1;
-
-	if(match(s, t->sh_name)) return t->section_number;
+	/* STB_LOCAL */
+	return 0 == (s->info >> 4);
+}
 
-	return lookup_section(s, t->next);
+struct elf_section_header* find_section_by_number(struct elf_object_file* f, int number)
+{
+	if((0 > number) || (number >= f->header->e_shnum)) return NULL;
+	return f->section_index[number];
 }
 
-void check_for_duplicate_symbols(char* s, struct symbol* sym)
+int symbol_is_linked(struct elf_object_file* f, struct elf_symbol* i)
 {
-	while(NULL != sym)
-	{
-		if(match(s, sym->name))
-		{
-			file_print("duplicate definition found for: ", stderr);
-			file_print(s, stderr);
-			file_print("\nAborting to prevent issues\n", stderr);
-			exit(EXIT_FAILURE);
-		}
+	/* Only if it has a name and is not undefined or common */
+	if(match("", i->st_name) || (0 == i->st_shndx) || (SHN_COMMON == i->st_shndx)) return FALSE;
+
+	/* It is an absolute address */
+	if(SHN_ABS == i->st_shndx) return TRUE;
 
-		sym = sym->next;
+	struct elf_section_header* s = find_section_by_number(f, i->st_shndx);
+	if(NULL == s)
+	{
+		file_print("I just got an st_shndx value I don't understand\nAborting so I don't miss something\n", stderr);
+		exit(EXIT_FAILURE);
 	}
+
+	/* Symbols in discarded sections go with them */
+	return NULL != s->output;
 }
 
-struct symbol* generate_symbol_table(struct elf_object_file* h)
+struct symbol* object_symbols(struct elf_object_file* h)
 {
-	if(NULL == h) return NULL;
-
-	SCM text_index = lookup_section(".text", h->symbol_table);
-	SCM data_index = lookup_section(".data", h->symbol_table);
-
-	struct symbol* r = generate_symbol_table(h->next);
-	struct symbol* hold = NULL;
+	/* Only needs the layout, the file's own symbols stay in the order they were defined */
+	struct symbol* r = NULL;
+	struct symbol* tail = NULL;
+	struct symbol* hold;
+	struct elf_section_header* s;
 	struct elf_symbol* i;
 	for(i = h->symbols; NULL != i; i = i->next)
 	{
-		/* Only add if have name and is not undefined */
-		if(!match("", i->st_name) && (0 != i->st_shndx))
+		if(symbol_is_linked(h, i))
 		{
-			check_for_duplicate_symbols(i->st_name, r);
-			hold = r;
-			r = calloc(1, sizeof(struct symbol));
-			r->name = i->st_name;
+			hold = calloc(1, sizeof(struct symbol));
+			hold->name = i->st_name;
+			hold->size = i->st_size;
+			hold->info = i->st_info;
+			hold->other = i->st_other;
 
-			if(text_index == i->st_shndx)
-			{
-				r->address = h->text->contents->starting_address + i->st_value;
-			}
-			else if(data_index == i->st_shndx)
-			{
-				r->address = h->data->contents->starting_address + i->st_value;
-			}
-			else if(0xFFF1 == i->st_shndx)
+			if(SHN_ABS == i->st_shndx)
 			{
 				/* It is an absolute address */
-				r->address = i->st_value;
+				hold->address = i->st_value;
+				hold->section = NULL;
 			}
 			else
 			{
-				file_print("I just got an st_shndx value I don't understand\nAborting so I don't miss something\n", stderr);
-				exit(EXIT_FAILURE);
+				s = find_section_by_number(h, i->st_shndx);
+				hold->address = s->contents->starting_address + i->st_value;
+				hold->section = s->output->name;
+				hold->output = s->output;
 			}
 
-			r->next = hold;
+			i->linked = hold;
+			if(NULL == tail) r = hold;
+			else tail->next = hold;
+			tail = hold;
 		}
 	}
 
 	return r;
 }
 
-char* find_address_symbol_name(SCM address)
+struct symbol* generate_symbol_table(struct elf_object_file* h)
 {
-	if(0 > address) return NULL;
-	struct symbol* s = symbol_table;
+	if(NULL == h) return NULL;
+
+	/* Later files are published first, so duplicates are found in the same order every time */
+	struct symbol* r = generate_symbol_table(h->next);
+	struct symbol* hold;
+	struct symbol* i = h->linked_symbols;
+	h->linked_symbols = NULL;
+	while(NULL != i)
+	{
+		hold = i->next;
+		publish_symbol(i);
+		i->next = r;
+		r = i;
+		i = hold;
+	}
+
+	return r;
+}
+
+struct symbol* find_symbol(char* name, struct symbol* s)
+{
+	/* Local symbols can not satisfy references from other files */
 	while(NULL != s)
 	{
-		if(address == s->address) return s->name;
+		if(!symbol_is_local(s) && match(name, s->name)) return s;
 		s = s->next;
 	}
-
 	return NULL;
 }
 
-SCM get_address_from_symbol(char* name)
+struct symbol* allocate_common_symbols(struct elf_object_file* h, struct symbol* table)
 {
-	require(NULL != name, "It is not possible to get the address when you don't give me a symbol's name\n");
+	/* Tentative definitions of the same name are merged into the largest one;
+	 * address holds the strictest alignment until they are placed */
+	struct symbol* commons = NULL;
+	struct symbol* c;
+	struct elf_symbol* i;
+	while(NULL != h)
+	{
+		for(i = h->symbols; NULL != i; i = i->next)
+		{
+			/* A real definition always wins over a common one */
+			if((SHN_COMMON == i->st_shndx) && !match("", i->st_name) && (NULL == find_global_symbol(i->st_name)))
+			{
+				c = find_symbol(i->st_name, commons);
+				if(NULL == c)
+				{
+					c = calloc(1, sizeof(struct symbol));
+					c->name = i->st_name;
+					c->info = i->st_info;
+					c->next = commons;
+					commons = c;
+				}
+				if(c->size < i->st_size) c->size = i->st_size;
+				if(c->address < i->st_value) c->address = i->st_value;
+			}
+		}
+		h = h->next;
+	}
 
-	struct symbol* s = symbol_table;
-	while(NULL != s)
+	if(NULL == commons) return table;
+
+	/* Place them at the end of the last zero filled section so they share it */
+	struct output_section* bss = NULL;
+	struct output_section* o;
+	for(o = output_map; NULL != o; o = o->next)
 	{
-		if(match(name, s->name)) return s->address;
-		s = s->next;
+		if(3 == segment_rank(o)) bss = o;
+	}
+	if(NULL == bss)
+	{
+		/* SHT_NOBITS with SHF_ALLOC + SHF_WRITE */
+		bss = new_output_section(".bss", 8, 3);
+		bss->address = data_base + data_size;
+		bss->offset = data_base_offset + data_size;
+	}
+
+	SCM next = data_base + data_size + bss_size;
+	SCM align;
+	while(NULL != commons)
+	{
+		c = commons;
+		commons = commons->next;
+		align = c->address;
+		if(1 < align) next = (next + align - 1) & ~(align - 1);
+		if(bss->alignment < align) bss->alignment = align;
+		c->address = next;
+		c->section = bss->name;
+		c->output = bss;
+		next = next + c->size;
+		c->next = table;
+		table = c;
+		publish_symbol(c);
 	}
+	bss_size = next - (data_base + data_size);
+	bss->size = next - bss->address;
+
+	return table;
+}
+
+SCM get_address_from_symbol(char* name)
+{
+	require(NULL != name, "It is not possible to get the address when you don't give me a symbol's name\n");
+
+	struct symbol* s = find_global_symbol(name);
+	if(NULL != s) return s->address;
 
 	file_print("Was unable to find symbol named: ", stderr);
 	file_print(name, stderr);
@@ -546,43 +726,288 @@ SCM get_address_from_symbol(char* name)
 	exit(EXIT_FAILURE);
 }
 
-struct relocation* collection_relocations(struct elf_object_file* f)
+int in_discarded_section(struct elf_object_file* f, struct elf_symbol* sym)
+{
+	struct elf_section_header* s = find_section_by_number(f, sym->st_shndx);
+	if(NULL == s) return FALSE;
+	return s->discarded;
+}
+
+SCM find_symbol_address(struct elf_object_file* f, struct elf_symbol* sym)
 {
-	if(NULL == f) return NULL;
+	/* STN_UNDEF, which a relocatable link leaves for references into a dropped COMDAT copy */
+	if(0 == sym->symbol_number) return 0;
 
-	struct relocation* r = collection_relocations(f->next);
-	struct relocation* hold = NULL;
-	struct elf_relocation* a = f->r_text;
-	SCM offset = -1;
+	/* Undefined and common symbols are resolved across all files */
+	if((0 == sym->st_shndx) || (SHN_COMMON == sym->st_shndx)) return get_address_from_symbol(sym->st_name);
 
-	while(NULL != a)
+	/* It is an absolute address */
+	if(SHN_ABS == sym->st_shndx) return sym->st_value;
+
+	/* Everything else is relative to a section in the same file */
+	struct elf_section_header* s = find_section_by_number(f, sym->st_shndx);
+	if(NULL != s)
 	{
-		/* Because ELF shoves the offset into where the value belongs to save disk space; we need to pull it out */
-		read_offset = a->r_offset;
-		offset = read_word(f->text->contents, "failed to read .data relocation offset from segment\n");
+		/* Symbols of a COMDAT copy that was dropped are the kept copy's */
+		if(s->discarded && (0 != (sym->st_info >> 4))) return get_address_from_symbol(sym->st_name);
+		require(NULL != s->contents, "Relocation refers to a section that is not being linked\n");
+		return s->contents->starting_address + sym->st_value;
+	}
 
-		/* Create our useful relocation record (pointing to the old) */
-		hold = r;
-		r = calloc(1, sizeof(struct relocation));
-		r->next = hold;
-		r->target_section = f->text;
-		r->target_offset = a->r_offset;
+	file_print("I just got an st_shndx value I don't understand\nAborting so I don't miss something\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+SCM read_implicit_addend(struct elf_section_header* target, SCM offset, struct relocation_type* handler)
+{
+	/* Because ELF shoves the offset into where the value belongs to save disk space; we need to pull it out */
+	read_offset = offset;
+	if(4 == handler->size) return read_word(target->contents, "failed to read relocation addend from segment\n");
+	if(2 == handler->size) return read_half(target->contents, "failed to read relocation addend from segment\n");
+	if(1 == handler->size) return get_char(target->contents);
+	return 0;
+}
+
+struct symbol* output_section_symbol(struct output_section* o)
+{
+	if(NULL != o->symbol) return o->symbol;
+
+	/* STT_SECTION with STB_LOCAL, at the start of the output section */
+	o->symbol = calloc(1, sizeof(struct symbol));
+	o->symbol->name = "";
+	o->symbol->info = 3;
+	o->symbol->section = o->name;
+	o->symbol->output = o;
+	o->symbol->address = o->address;
+	return o->symbol;
+}
+
+struct symbol* undefined_output_symbol(struct elf_symbol* sym)
+{
+	/* Left for the final link, the null section at index 0 makes it SHN_UNDEF */
+	struct symbol* r = calloc(1, sizeof(struct symbol));
+	r->name = sym->st_name;
+	r->info = sym->st_info;
+	r->other = sym->st_other;
+	r->section = "";
+	publish_symbol(r);
+	r->next = symbol_table;
+	symbol_table = r;
+	return r;
+}
 
-		/* Depending if the relocation actually gave us the name or the segment where to find it */
-		r->symbol_name = a->name;
-		if(match(".data", a->name)) r->symbol_name = find_address_symbol_name(f->data->contents->starting_address + offset);
-		if(match(".text", a->name)) r->symbol_name = find_address_symbol_name(f->text->contents->starting_address + offset);
+struct symbol* output_relocation_symbol(struct elf_object_file* f, struct elf_symbol* sym)
+{
+	/* Named symbols are found by name, the rest by the output section they landed in.
+	 * A relocatable output refers to locals through their section as well */
+	struct symbol* r;
+	if(!match("", sym->st_name) && (3 != (sym->st_info & 0xF)))
+	{
+		if(0 != (sym->st_info >> 4))
+		{
+			r = find_global_symbol(sym->st_name);
+			if((NULL == r) && Relocatable) r = undefined_output_symbol(sym);
+			return r;
+		}
+		if(!Relocatable) return sym->linked;
+	}
+
+	struct elf_section_header* s = find_section_by_number(f, sym->st_shndx);
+	if((NULL == s) || (NULL == s->output)) return sym->linked;
+	return output_section_symbol(s->output);
+}
+
+struct relocation* new_relocation(struct relocation* next, struct elf_object_file* f, struct elf_section_header* target, struct elf_symbol* sym, SCM offset, SCM type)
+{
+	require(NULL != target, "Relocation found for a section that is not being linked\n");
+	struct relocation* r = calloc(1, sizeof(struct relocation));
+	r->next = next;
+	r->symbol_name = sym->st_name;
 
+	r->target_section = target;
+	r->target_offset = offset;
+	r->type = type;
+
+	/* Loaded sections keep what each relocation pointed at for --emit-relocs */
+	if(EmitRelocs && (0 != (target->sh_flags & 2))) r->output_symbol = output_relocation_symbol(f, sym);
+
+	/* A relocatable output resolves nothing, only the offset from a section symbol is known */
+	if(Relocatable)
+	{
+		if((NULL != r->output_symbol) && (3 == r->output_symbol->info)) r->symbol_address = find_symbol_address(f, sym) - r->output_symbol->address;
+		return r;
+	}
+
+	/* A dropped COMDAT copy's locals point nowhere, as with other linkers. Debug information and
+	 * the .eh_frame entries of the losing copy refer to them, and an FDE starting at 0 covers nothing */
+	if((0 == (sym->st_info >> 4)) && in_discarded_section(f, sym)) r->symbol_address = 0;
+	else r->symbol_address = find_symbol_address(f, sym);
+
+	/* References that still go through the GOT need their entry */
+	if(2 == lookup_relocation_type(type)->got) r->got_offset = got_entry_offset(f, sym);
+	return r;
+}
+
+struct relocation* collect_implicit_relocations(struct relocation* r, struct elf_object_file* f, struct elf_relocation* a, struct elf_section_header* target)
+{
+	while(NULL != a)
+	{
+		r = new_relocation(r, f, target, a->symbol, a->r_offset, a->r_type);
+		r->addend = read_implicit_addend(target, a->r_offset, lookup_relocation_type(a->r_type));
 		a = a->next;
 	}
+	return r;
+}
 
+struct relocation* collect_explicit_relocations(struct relocation* r, struct elf_object_file* f, struct elf_adjusted_relocation* a, struct elf_section_header* target)
+{
+	while(NULL != a)
+	{
+		r = new_relocation(r, f, target, a->symbol, a->r_offset, a->r_type);
+		r->addend = a->r_addend;
+		a = a->next;
+	}
 	return r;
 }
 
+struct relocation* collect_object_relocations(struct relocation* r, struct elf_object_file* f)
+{
+	struct elf_section_header* s;
+	for(s = f->sections; NULL != s; s = s->next)
+	{
+		/* Only SHF_ALLOC sections, debug sections are patched in the output file */
+		if((NULL != s->output) && (0 != (s->sh_flags & 2)))
+		{
+			r = collect_implicit_relocations(r, f, s->r, s);
+			r = collect_explicit_relocations(r, f, s->ar, s);
+		}
+	}
+	return r;
+}
 
-void write_elf_header(struct segment* f)
+int relocation_before(struct relocation* a, struct relocation* b)
 {
-	read_offset = 0;
+	/* Group by target section first, then by type and finally walk each group in offset order */
+	SCM a_start = a->target_section->contents->starting_address;
+	SCM b_start = b->target_section->contents->starting_address;
+	if(a_start != b_start) return a_start < b_start;
+	if(a->type != b->type) return a->type < b->type;
+	return a->target_offset <= b->target_offset;
+}
+
+struct relocation* group_relocations(struct relocation* head)
+{
+	if((NULL == head) || (NULL == head->next)) return head;
+
+	/* Split the list in half */
+	struct relocation* slow = head;
+	struct relocation* fast = head->next;
+	while((NULL != fast) && (NULL != fast->next))
+	{
+		slow = slow->next;
+		fast = fast->next->next;
+	}
+	struct relocation* back = slow->next;
+	slow->next = NULL;
+
+	struct relocation* a = group_relocations(head);
+	struct relocation* b = group_relocations(back);
+
+	/* Merge the sorted halves back together */
+	struct relocation* r = NULL;
+	struct relocation* tail = NULL;
+	struct relocation* hold;
+	while((NULL != a) || (NULL != b))
+	{
+		if((NULL == b) || ((NULL != a) && relocation_before(a, b)))
+		{
+			hold = a;
+			a = a->next;
+		}
+		else
+		{
+			hold = b;
+			b = b->next;
+		}
+
+		if(NULL == tail) r = hold;
+		else tail->next = hold;
+		tail = hold;
+	}
+	tail->next = NULL;
+
+	return r;
+}
+
+
+SCM data_file_offset()
+{
+	return data_base_offset;
+}
+
+SCM section_header_size()
+{
+	if(largeint) return 64;
+	return 40;
+}
+
+struct output_section* append_output_section(struct output_section* list, struct output_section* r)
+{
+	/* Appended so the list stays in section index order */
+	if(NULL == list) return r;
+
+	struct output_section* i = list;
+	while(NULL != i->next) i = i->next;
+	i->next = r;
+
+	/* r may be the head of a list of its own */
+	while(NULL != r)
+	{
+		r->index = i->index + 1;
+		i = r;
+		r = r->next;
+	}
+	return list;
+}
+
+struct output_section* add_output_section(struct output_section* list, char* name, int type, SCM flags, SCM address, SCM offset, SCM size)
+{
+	struct output_section* r = calloc(1, sizeof(struct output_section));
+	r->name = name;
+	r->type = type;
+	r->flags = flags;
+	r->address = address;
+	r->offset = offset;
+	r->size = size;
+	r->alignment = 1;
+	return append_output_section(list, r);
+}
+
+struct output_section* last_output_section(struct output_section* list)
+{
+	while(NULL != list->next) list = list->next;
+	return list;
+}
+
+void write_section_header(struct segment* f, struct output_section* s)
+{
+	write_word(f, s->name_offset);
+	write_word(f, s->type);
+	write_register(f, s->flags);
+	/* Sections of a relocatable output are not placed yet */
+	if(Relocatable) write_register(f, 0);
+	else write_register(f, s->address);
+	write_register(f, s->offset);
+	write_register(f, s->size);
+	write_word(f, s->link);
+	write_word(f, s->info);
+	write_register(f, s->alignment);
+	write_register(f, s->entry_size);
+}
+
+void write_elf_header(struct segment* f, SCM section_headers, int section_count, int section_names)
+{
+	write_offset = 0;
 	/* put in the magic */
 	put_char('\x7f', f);
 	put_char('E', f);
@@ -601,16 +1026,382 @@ void write_elf_header(struct segment* f)
 	put_char(0, f);
 	put_char(0, f);
 	put_char(0, f);
-	/* set e_type to ET_EXEC */
-	write_half(f, 2);
+	/* set e_type to ET_REL for -r, otherwise ET_EXEC */
+	if(Relocatable) write_half(f, 1);
+	else write_half(f, 2);
 	write_half(f, current_file->header->e_machine);
 	/* Set e_version to 1 */
 	write_word(f, 1);
+	if(Relocatable)
+	{
+		/* No entry point and no program headers */
+		write_register(f, 0);
+		write_register(f, 0);
+	}
+	else
+	{
+		write_register(f, entry->address);
+		/* Program headers follow immediately */
+		if(largeint) write_register(f, 64);
+		else write_register(f, 52);
+	}
+	write_register(f, section_headers);
+	write_word(f, current_file->header->e_flags);
+	if(largeint) write_half(f, 64);
+	else write_half(f, 52);
+	if(Relocatable) write_half(f, 0);
+	else if(largeint) write_half(f, 56);
+	else write_half(f, 32);
+	write_half(f, output_program_header_count());
+	write_half(f, section_header_size());
+	if(SHN_LORESERVE <= section_count) write_half(f, 0);
+	else write_half(f, section_count);
+	if(SHN_LORESERVE <= section_names) write_half(f, SHN_XINDEX);
+	else write_half(f, section_names);
+}
+
+void write_program_header(struct segment* f, int type, int flags, SCM offset, SCM address, SCM file_size, SCM memory_size, SCM alignment)
+{
+	write_word(f, type);
+	if(largeint) write_word(f, flags);
+	write_register(f, offset);
+	write_register(f, address);
+	write_register(f, address);
+	write_register(f, file_size);
+	write_register(f, memory_size);
+	if(!largeint) write_word(f, flags);
+	write_register(f, alignment);
+}
+
+void write_segment_contents(struct segment* f, struct segment* s, SCM offset)
+{
+	SCM i;
+	write_offset = offset;
+	for(i = 0; i < s->size; i = i + 1)
+	{
+		put_char(s->contents[i], f);
+	}
+}
+
+struct symbol* find_entry_point()
+{
+	struct symbol* r = find_global_symbol("_start");
+	if(NULL != r) return r;
+
+	/* Without _start just begin at the start of .text */
+	r = calloc(1, sizeof(struct symbol));
+	r->name = "";
+	r->address = BaseAddress + text_file_offset();
+	struct output_section* text = find_output_section(".text");
+	if(NULL != text) r->address = text->address;
+	return r;
+}
+
+int piece_in_input(struct elf_section_header* p)
+{
+	/* As opposed to zero fill and sections the linker made up */
+	return (NULL != p->file) && (8 != p->sh_type);
 }
 
-struct segment* output_generate()
+void place_piece(struct segment* f, struct elf_section_header* p)
 {
-	struct segment* r = output_buffer_generate();
-	write_elf_header(r);
+	struct output_section* o = p->output;
+	write_segment_contents(f, p->contents, o->offset + p->contents->starting_address - o->address);
+
+	/* From here on the piece lives in the output, so relocations are applied there */
+	p->contents->contents = f->contents + o->offset + p->contents->starting_address - o->address;
+}
+
+char* relocation_section_name(char* name)
+{
+	char* r = calloc(string_length(name) + 5, sizeof(char));
+	r[0] = '.';
+	r[1] = 'r';
+	r[2] = 'e';
+	r[3] = 'l';
+	SCM i = 0;
+	while(0 != name[i])
+	{
+		r[i + 4] = name[i];
+		i = i + 1;
+	}
+	return r;
+}
+
+struct output_section* add_relocation_sections(struct output_section* list)
+{
+	/* One SHT_REL per loaded section, filled in as the relocations are applied */
+	struct relocation* i;
+	for(i = relocation_table; NULL != i; i = i->next)
+	{
+		i->target_section->output->relocation_count = i->target_section->output->relocation_count + 1;
+	}
+
+	/* Chained up separately and appended once, -r of a big archive can make tens of thousands */
+	struct output_section* relocations = NULL;
+	struct output_section* tail = NULL;
+	struct output_section* o;
+	struct output_section* s;
+	for(o = output_map; (NULL != o) && (0 != (o->flags & 2)); o = o->next)
+	{
+		if(0 != o->relocation_count)
+		{
+			/* SHT_REL with SHF_INFO_LINK, applying to o and in its group if it has one */
+			s = add_output_section(NULL, relocation_section_name(o->name), 9, 0x40 | (o->flags & 0x200), 0, 0, o->relocation_count * 8);
+			if(NULL == tail) relocations = s;
+			else tail->next = s;
+			tail = s;
+			s->info = o->index;
+			s->entry_size = 8;
+			s->alignment = 4;
+			s->contents = calloc(1, sizeof(struct segment));
+			s->contents->size = s->size;
+			o->relocations = s;
+		}
+	}
+	return append_output_section(list, relocations);
+}
+
+struct symbol* add_section_symbols(struct symbol* table)
+{
+	struct output_section* o;
+	for(o = output_map; (NULL != o) && (0 != (o->flags & 2)); o = o->next)
+	{
+		if(NULL != o->symbol)
+		{
+			o->symbol->next = table;
+			table = o->symbol;
+		}
+	}
+	return table;
+}
+
+void find_group_signatures(struct output_section* groups)
+{
+	struct output_section* g;
+	for(g = groups; (NULL != g) && (17 == g->type); g = g->next)
+	{
+		g->symbol = g->group->file->symbol_index[g->group->sh_info]->linked;
+	}
+
+	/* A group named by a section symbol is named by its first member's */
+	struct output_section* o;
+	for(o = output_map; NULL != o; o = o->next)
+	{
+		if((NULL != o->group) && (NULL == o->group->output->symbol)) o->group->output->symbol = output_section_symbol(o);
+	}
+}
+
+void fill_group_sections(struct output_section* groups, int symtab)
+{
+	/* GRP_COMDAT followed by the member sections and their relocations */
+	struct output_section* g;
+	struct output_section* o;
+	for(g = groups; (NULL != g) && (17 == g->type); g = g->next) g->size = 4;
+	for(o = output_map; NULL != o; o = o->next)
+	{
+		if(NULL != o->group) o->group->output->size = o->group->output->size + 4;
+		if((NULL != o->group) && (NULL != o->relocations)) o->group->output->size = o->group->output->size + 4;
+	}
+
+	/* Each group's size is then reused as where its next member goes */
+	for(g = groups; (NULL != g) && (17 == g->type); g = g->next)
+	{
+		g->link = symtab;
+		g->info = g->symbol->symtab_index;
+		g->contents = calloc(1, sizeof(struct segment));
+		g->contents->size = g->size;
+		g->contents->contents = calloc(g->size, sizeof(char));
+		write_offset = 0;
+		write_word(g->contents, 1);
+		g->size = 4;
+	}
+
+	for(o = output_map; NULL != o; o = o->next)
+	{
+		if(NULL != o->group)
+		{
+			g = o->group->output;
+			write_offset = g->size;
+			write_word(g->contents, o->index);
+			g->size = g->size + 4;
+		}
+		if((NULL != o->group) && (NULL != o->relocations))
+		{
+			write_offset = g->size;
+			write_word(g->contents, o->relocations->index);
+			g->size = g->size + 4;
+		}
+	}
+}
+
+struct output_section* generate_output_sections(SCM note_offset)
+{
+	SCM data_offset = data_file_offset();
+
+	/* SHT_NULL */
+	struct output_section* r = add_output_section(NULL, "", 0, 0, 0, 0, 0);
+	if(BuildID)
+	{
+		/* SHT_NOTE with SHF_ALLOC */
+		r = add_output_section(r, ".note.gnu.build-id", 7, 2, BaseAddress + note_offset, note_offset, build_id_note_size());
+		last_output_section(r)->alignment = 4;
+	}
+
+	/* Groups kept for -r have to come before their members */
+	r = append_output_section(r, output_groups);
+
+	/* Everything that is loaded, in address order */
+	r = append_output_section(r, output_map);
+
+	struct output_section* s;
+	if(EmitRelocs)
+	{
+		r = add_relocation_sections(r);
+		find_group_signatures(output_groups);
+		symbol_table = add_section_symbols(symbol_table);
+	}
+
+	if(!StripAll)
+	{
+		/* SHT_SYMTAB linked to the SHT_STRTAB after it */
+		struct segment* strtab = generate_output_strtab(symbol_table);
+		r = add_output_section(r, ".symtab", 2, 0, 0, 0, 0);
+		s = last_output_section(r);
+		s->contents = generate_output_symtab(symbol_table, r);
+		s->size = s->contents->size;
+		s->link = s->index + 1;
+		s->info = 1 + count_local_symbols(symbol_table);
+		s->entry_size = symbol_entry_size();
+		s->alignment = 4;
+		if(largeint) s->alignment = 8;
+		int symtab = s->index;
+
+		r = add_output_section(r, ".strtab", 3, 0, 0, 0, strtab->size);
+		last_output_section(r)->contents = strtab;
+
+		/* SHT_SYMTAB_SHNDX, only when a symbol is in a section past SHN_LORESERVE */
+		struct segment* shndx = generate_output_symtab_shndx(symbol_table, r);
+		if(NULL != shndx)
+		{
+			r = add_output_section(r, ".symtab_shndx", 18, 0, 0, 0, shndx->size);
+			s = last_output_section(r);
+			s->contents = shndx;
+			s->link = symtab;
+			s->entry_size = 4;
+			s->alignment = 4;
+		}
+
+		/* The relocation sections name the symbols in .symtab */
+		for(s = output_map; (NULL != s) && (0 != (s->flags & 2)); s = s->next)
+		{
+			if(NULL != s->relocations) s->relocations->link = symtab;
+		}
+		fill_group_sections(output_groups, symtab);
+	}
+
+	/* Passed through debug sections are copied in after everything else */
+	r = append_output_section(r, debug_sections);
+
+	r = add_output_section(r, ".shstrtab", 3, 0, 0, 0, 0);
+	s = last_output_section(r);
+	s->contents = generate_section_name_table(r);
+	s->size = s->contents->size;
+
+	/* Past SHN_LORESERVE the section count and the name table's index move into section 0 */
+	if(SHN_LORESERVE <= s->index + 1) r->size = s->index + 1;
+	if(SHN_LORESERVE <= s->index) r->link = s->index;
+
+	/* Everything that is not loaded goes after .data */
+	SCM next = data_offset + data_size;
+	for(s = r; NULL != s; s = s->next)
+	{
+		if(NULL != s->contents)
+		{
+			next = align_up(next, s->alignment);
+			s->offset = next;
+			next = next + s->size;
+		}
+	}
+
+	return r;
+}
+
+struct segment* output_generate(int page_size, FILE* destination)
+{
+	SCM data_offset = data_file_offset();
+	SCM note_offset = output_program_headers_end();
+	entry = find_entry_point();
+
+	struct output_section* sections = generate_output_sections(note_offset);
+	struct output_section* last = last_output_section(sections);
+	SCM section_headers = align_up(last->offset + last->size, sizeof(SCM));
+	section_header_offset = section_headers;
+	struct segment* r = output_file_map(destination, section_headers + ((last->index + 1) * section_header_size()));
+	write_elf_header(r, section_headers, last->index + 1, last->index);
+
+	/* Debug sections go after the section headers, straight from the inputs */
+	struct output_section* s;
+	SCM next = r->size;
+	for(s = sections; NULL != s; s = s->next)
+	{
+		if((NULL != s->pieces) && (0 == (s->flags & 2)))
+		{
+			next = align_up(next, s->alignment);
+			s->offset = next;
+			next = next + s->size;
+		}
+	}
+
+	/* A relocatable output is only sections */
+	if(!Relocatable)
+	{
+		/* .text is mapped along with the headers and any huge page padding; PT_LOAD with PF_R + PF_X */
+		if(SegmentAlign > page_size) write_program_header(r, 1, 5, 0, BaseAddress, data_offset, data_offset, SegmentAlign);
+		else write_program_header(r, 1, 5, 0, BaseAddress, data_offset, data_offset, page_size);
+		/* .data, with .bss only in p_memsz; PT_LOAD with PF_R + PF_W */
+		write_program_header(r, 1, 6, data_offset, data_base, data_size, data_size + bss_size, page_size);
+	}
+
+	/* The note lives between the program headers and .text; PT_NOTE with PF_R */
+	if(BuildID)
+	{
+		write_program_header(r, 4, 4, note_offset, BaseAddress + note_offset, build_id_note_size(), build_id_note_size(), 4);
+		write_build_id_note(r, note_offset);
+	}
+
+	/* Loaded sections are written piece by piece, SHT_NOBITS has nothing to write */
+	struct elf_section_header* p;
+	SCM end;
+	for(s = sections; NULL != s; s = s->next)
+	{
+		if((0 != (s->flags & 2)) && (8 != s->type))
+		{
+			end = s->address;
+			for(p = s->pieces; NULL != p; p = p->next_piece)
+			{
+				/* Alignment gaps in code are NOPs, data gaps stay zero */
+				if((0 != (s->flags & 4)) && (end < p->contents->starting_address)) fill_code_gap(r, s->offset + end - s->address, p->contents->starting_address - end);
+				end = p->contents->starting_address + p->contents->size;
+
+				/* With --low-memory the objects are streamed in one at a time later */
+				if(!LowMemory || !piece_in_input(p)) place_piece(r, p);
+			}
+		}
+	}
+
+	/* .symtab, .strtab and .shstrtab followed by the section headers */
+	for(s = sections; NULL != s; s = s->next)
+	{
+		/* --emit-relocs sections are filled in place as the relocations are applied */
+		if(9 == s->type) s->contents->contents = r->contents + s->offset;
+		else if(NULL != s->contents) write_segment_contents(r, s->contents, s->offset);
+	}
+	write_offset = section_headers;
+	for(s = sections; NULL != s; s = s->next)
+	{
+		write_section_header(r, s);
+	}
+
 	return r;
 }
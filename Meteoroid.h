@@ -24,6 +24,17 @@
 // CONSTANT MAX_STRING 4096
 #define MAX_STRING 4096
 
+/* st_shndx values from the reserved range are kept below zero, so a
+ * section numbered past 0xFF00 through SHN_XINDEX can not be taken for one */
+// CONSTANT SHN_LORESERVE 0xFF00
+#define SHN_LORESERVE 0xFF00
+// CONSTANT SHN_XINDEX 0xFFFF
+#define SHN_XINDEX 0xFFFF
+// CONSTANT SHN_ABS -15
+#define SHN_ABS -15
+// CONSTANT SHN_COMMON -14
+#define SHN_COMMON -14
+
 int match(char* a, char* b);
 void file_print(char* s, FILE* f);
 void require(int bool, char* error);
@@ -66,9 +77,9 @@ struct elf_program_header
 struct segment
 {
 	char* name;
-	int size;
+	SCM size;
 	char* contents;
-	int starting_address;
+	SCM starting_address;
 };
 
 struct elf_section_header
@@ -85,7 +96,15 @@ struct elf_section_header
 	SCM sh_addralign;
 	SCM sh_entsize;
 	int section_number;
+	int discarded;
 	struct segment* contents;
+	struct elf_object_file* file;
+	struct output_section* output;
+	struct placement* placement;
+	struct elf_section_header* group;
+	struct elf_relocation* r;
+	struct elf_adjusted_relocation* ar;
+	struct elf_section_header* next_piece;
 	struct elf_section_header* next;
 };
 
@@ -99,6 +118,7 @@ struct elf_symbol
 	int st_other;
 	int st_shndx;
 	int symbol_number;
+	struct symbol* linked;
 	struct elf_symbol* next;
 };
 
@@ -106,12 +126,45 @@ struct symbol
 {
 	char* name;
 	SCM address;
+	SCM size;
+	int info;
+	int other;
+	char* section;
+	struct output_section* output;
+	SCM name_offset;
+	SCM symtab_index;
 	struct symbol* next;
+	struct symbol* next_in_bucket;
+};
+
+struct output_section
+{
+	char* name;
+	SCM name_offset;
+	int type;
+	SCM flags;
+	SCM address;
+	SCM offset;
+	SCM size;
+	int link;
+	int info;
+	SCM alignment;
+	SCM entry_size;
+	int index;
+	struct segment* contents;
+	struct elf_section_header* pieces;
+	struct elf_section_header* last_piece;
+	struct output_section* relocations;
+	SCM relocation_count;
+	struct symbol* symbol;
+	struct elf_section_header* group;
+	struct output_section* next;
 };
 
 struct elf_relocation
 {
 	char* name;
+	struct elf_symbol* symbol;
 	SCM r_offset;
 	SCM r_info;
 	SCM r_type;
@@ -122,6 +175,7 @@ struct elf_relocation
 struct elf_adjusted_relocation
 {
 	char* name;
+	struct elf_symbol* symbol;
 	SCM r_offset;
 	int r_info;
 	int r_info_top;
@@ -131,49 +185,185 @@ struct elf_adjusted_relocation
 	struct elf_adjusted_relocation* next;
 };
 
+struct relocation_type
+{
+	char* name;
+	SCM type;
+	int size;
+	int pc_relative;
+	int got;
+};
+
 struct relocation
 {
 	char* symbol_name;
+	SCM symbol_address;
 	struct elf_section_header* target_section;
 	SCM target_offset;
+	SCM addend;
 	SCM type;
+	SCM got_offset;
+	struct symbol* output_symbol;
 	struct relocation* next;
 };
 
+struct got_entry
+{
+	struct elf_object_file* file;
+	struct elf_symbol* symbol;
+	SCM offset;
+	struct got_entry* next;
+};
+
+struct placement
+{
+	struct elf_object_file* file;
+	struct elf_section_header* section;
+	SCM position;
+	SCM rank;
+	SCM samples;
+	SCM size;
+	struct placement* leader;
+	struct placement* members;
+	struct placement* last;
+	struct call_edge* calls;
+	struct placement* next;
+};
+
+struct call_edge
+{
+	struct placement* caller;
+	struct placement* callee;
+	SCM weight;
+	struct call_edge* next_from_caller;
+	struct call_edge* next;
+};
+
+struct name_entry
+{
+	char* name;
+	int global;
+	struct placement* placement;
+	SCM count;
+	struct name_entry* next;
+};
+
+struct name_index
+{
+	struct name_entry** buckets;
+	SCM size;
+};
+
+struct merged_string
+{
+	char* name;
+	SCM length;
+	SCM offset;
+	struct symbol* symbol;
+	struct output_section* section;
+	struct merged_string* next;
+};
+
+struct section_rule
+{
+	int c;
+	char* exact;
+	char* prefix;
+	struct section_rule* children;
+	struct section_rule* next;
+};
+
 struct elf_object_file
 {
 	char* name;
+	struct segment* input;
 	struct elf_header* header;
 	struct elf_program_header* segments;
 	struct elf_section_header* sections;
 	struct elf_section_header* string_table;
 	struct elf_section_header* symbol_table;
+	struct elf_section_header* symbol_index_table;
+	struct elf_section_header** section_index;
 	struct elf_symbol* symbols;
-	struct elf_section_header* text;
-	struct elf_section_header* data;
-	struct elf_section_header* bss;
-	struct elf_section_header* _rel_text;
-	struct elf_relocation* r_text;
-	struct elf_section_header* _rela_text;
-	struct elf_adjusted_relocation* ar_text;
-	struct elf_section_header* _rel_data;
-	struct elf_relocation* r_data;
-	struct elf_section_header* _rela_data;
-	struct elf_adjusted_relocation* ar_data;
+	struct elf_symbol** symbol_index;
+	SCM symbol_count;
+	struct symbol* linked_symbols;
+	struct relocation* relocations;
+	struct relocation* debug_relocations;
 	struct elf_object_file* next;
 };
 
+struct comdat_group
+{
+	char* signature;
+	struct elf_object_file* file;
+	struct comdat_group* next;
+};
+
+struct deflate_stream
+{
+	char* contents;
+	SCM size;
+	int bits;
+	int count;
+};
+
+struct task_edge
+{
+	struct task* task;
+	struct task_edge* next;
+};
+
+struct task
+{
+	int kind;
+	struct elf_object_file* file;
+	int waiting;
+	struct task_edge* dependents;
+	struct task* next_ready;
+	struct task* next;
+};
+
 /* Some globals to keep things simpler */
 int BigEndian;
 int largeint;
 SCM BaseAddress;
+SCM SegmentAlign;
+SCM FunctionAlign;
 int VERBOSE;
 int DEBUG;
+int BuildID;
+int StripAll;
+int LowMemory;
+int CompressDebug;
+int EmitRelocs;
+int Relocatable;
+int PerfCounters;
+char* OrderingFile;
+int CallGraph;
+char* SampleFile;
 struct elf_object_file* current_file;
 struct symbol* symbol_table;
+struct symbol** symbol_buckets;
+SCM symbol_bucket_count;
+SCM global_symbol_count;
+struct comdat_group** comdat_groups;
 struct relocation* relocation_table;
+struct output_section* output_map;
+struct output_section* output_map_tail;
+struct output_section* output_groups;
+struct output_section* output_groups_tail;
+struct section_rule* section_rules;
+struct output_section* debug_sections;
+struct output_section* global_offset_table;
+struct got_entry* got_entries;
+struct relocation* debug_relocation_table;
 struct symbol* entry;
 SCM text_size;
 SCM data_size;
+SCM bss_size;
+SCM data_base;
+SCM data_base_offset;
+SCM section_header_offset;
 SCM read_offset;
 SCM write_offset;
@@ -0,0 +1,233 @@
+#!/bin/sh
+## Copyright (C) 2020 Jeremiah Orians
+## This file is part of M3-Meteoroid.
+##
+## M3-Meteoroid is free software: you can redistribute it and/or modify
+## it under the terms of the GNU General Public License as published by
+## the Free Software Foundation, either version 3 of the License, or
+## (at your option) any later version.
+##
+## M3-Meteoroid is distributed in the hope that it will be useful,
+## but WITHOUT ANY WARRANTY; without even the implied warranty of
+## MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+## GNU General Public License for more details.
+##
+## You should have received a copy of the GNU General Public License
+## along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
+
+# Runs every link in a corpus file several times and compares the times
+# against a saved baseline. Each corpus line is "name: arguments", where the
+# arguments are given to the linker from the corpus file's directory and
+# # starts a comment. Phase times come from --perf-counters, the whole link
+# is timed here as "total".
+#
+# A phase regresses when its mean is more than the threshold slower than the
+# baseline and a one sided Welch t-test says the difference is significant.
+# Any regression gives exit status 1. Without a baseline, or with -s, the
+# results become the new baseline instead.
+
+set -eu
+
+linker=bin/M3-Meteoroid-x86
+runs=10
+threshold=5
+alpha=0.05
+baseline=bench/baseline.txt
+save=false
+
+usage()
+{
+	echo "usage: $0 [-l linker] [-r runs] [-t threshold%] [-a alpha] [-b baseline] [-s] corpus" >&2
+	exit 2
+}
+
+while getopts l:r:t:a:b:s option
+do
+	case "$option" in
+		l) linker=$OPTARG ;;
+		r) runs=$OPTARG ;;
+		t) threshold=$OPTARG ;;
+		a) alpha=$OPTARG ;;
+		b) baseline=$OPTARG ;;
+		s) save=true ;;
+		*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ 1 -eq $# ] || usage
+corpus=$1
+
+# Everything is resolved before changing into the corpus directory
+[ -x "$linker" ] || { echo "$0: no linker at $linker" >&2; exit 2; }
+[ -r "$corpus" ] || { echo "$0: can not read corpus $corpus" >&2; exit 2; }
+linker=$(cd "$(dirname "$linker")" && pwd)/$(basename "$linker")
+corpus_dir=$(cd "$(dirname "$corpus")" && pwd)
+corpus=$corpus_dir/$(basename "$corpus")
+case "$baseline" in
+	/*) ;;
+	*) baseline=$(pwd)/$baseline ;;
+esac
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+samples=$work/samples
+
+now()
+{
+	date +%s%N
+}
+
+# One sample per line: link phase nanoseconds
+run_link()
+{
+	name=$1
+	shift
+	start=$(now)
+	if ! (cd "$corpus_dir" && "$linker" "$@" --perf-counters -o "$work/a.out") 2> "$work/stderr"
+	then
+		echo "$0: link $name failed" >&2
+		cat "$work/stderr" >&2
+		exit 2
+	fi
+	end=$(now)
+	echo "$name total $((end - start))" >> "$samples"
+
+	# Per object phases are added up so every run has one sample per phase
+	awk -v name="$name" '
+		/^perf: / {
+			line = substr($0, 7)
+			colon = index(line, ": time-ns ")
+			phase = substr(line, 1, colon - 1)
+			paren = index(phase, " (")
+			if(0 != paren) phase = substr(phase, 1, paren - 1)
+			gsub(/ /, "-", phase)
+			split(substr(line, colon + 10), fields, " ")
+			sum[phase] += fields[1]
+		}
+		END { for(phase in sum) print name, phase, sum[phase] }
+	' "$work/stderr" >> "$samples"
+}
+
+: > "$samples"
+grep -v '^[[:space:]]*\(#\|$\)' "$corpus" > "$work/links" || true
+[ -s "$work/links" ] || { echo "$0: no links in $corpus" >&2; exit 2; }
+while IFS= read -r line
+do
+	name=${line%%:*}
+	arguments=${line#*:}
+	i=0
+	while [ "$i" -lt "$runs" ]
+	do
+		# Word splitting of the arguments is intended
+		# shellcheck disable=SC2086
+		run_link "$name" $arguments
+		i=$((i + 1))
+	done
+done < "$work/links"
+
+if $save || [ ! -e "$baseline" ]
+then
+	cp "$samples" "$baseline"
+	echo "Saved $runs runs of each link as the baseline in $baseline"
+	exit 0
+fi
+
+awk -v threshold="$threshold" -v alpha="$alpha" '
+	# ln(gamma(x)) by the Lanczos approximation
+	function log_gamma(x,    t, s) {
+		t = x + 5.5
+		t -= (x + 0.5) * log(t)
+		s = 1.000000000190015 + 76.18009172947146 / (x + 1) - 86.50532032941677 / (x + 2) \
+			+ 24.01409824083091 / (x + 3) - 1.231739572450155 / (x + 4) \
+			+ 0.1208650973866179e-2 / (x + 5) - 0.5395239384953e-5 / (x + 6)
+		return -t + log(2.5066282746310005 * s / x)
+	}
+
+	# Continued fraction for the regularized incomplete beta function
+	function beta_fraction(a, b, x,    m, m2, aa, c, d, del, h) {
+		c = 1
+		d = 1 - (a + b) * x / (a + 1)
+		if(d * d < 1e-300) d = 1e-300
+		d = 1 / d
+		h = d
+		for(m = 1; m <= 200; m++) {
+			m2 = 2 * m
+			aa = m * (b - m) * x / ((a + m2 - 1) * (a + m2))
+			d = 1 + aa * d; if(d * d < 1e-300) d = 1e-300
+			c = 1 + aa / c; if(c * c < 1e-300) c = 1e-300
+			d = 1 / d
+			h *= d * c
+			aa = -(a + m) * (a + b + m) * x / ((a + m2) * (a + m2 + 1))
+			d = 1 + aa * d; if(d * d < 1e-300) d = 1e-300
+			c = 1 + aa / c; if(c * c < 1e-300) c = 1e-300
+			d = 1 / d
+			del = d * c
+			h *= del
+			if((del - 1) * (del - 1) < 1e-20) break
+		}
+		return h
+	}
+
+	function incomplete_beta(a, b, x,    front) {
+		if(x <= 0) return 0
+		if(x >= 1) return 1
+		front = exp(log_gamma(a + b) - log_gamma(a) - log_gamma(b) + a * log(x) + b * log(1 - x))
+		if(x < (a + 1) / (a + b + 2)) return front * beta_fraction(a, b, x) / a
+		return 1 - front * beta_fraction(b, a, 1 - x) / b
+	}
+
+	# P(T > t) for Student t with df degrees of freedom
+	function upper_tail(t, df,    p) {
+		p = 0.5 * incomplete_beta(df / 2, 0.5, df / (df + t * t))
+		if(t < 0) return 1 - p
+		return p
+	}
+
+	FNR == 1 { file++ }
+	{
+		key = $1 " " $2
+		keys[key] = 1
+		n[file, key]++
+		sum[file, key] += $3
+		square[file, key] += $3 * $3
+	}
+	END {
+		status = 0
+		for(key in keys) {
+			if((n[1, key] < 2) || (n[2, key] < 2)) continue
+			m1 = sum[1, key] / n[1, key]
+			m2 = sum[2, key] / n[2, key]
+			v1 = (square[1, key] - n[1, key] * m1 * m1) / (n[1, key] - 1)
+			v2 = (square[2, key] - n[2, key] * m2 * m2) / (n[2, key] - 1)
+			if(v1 < 0) v1 = 0
+			if(v2 < 0) v2 = 0
+			e1 = v1 / n[1, key]
+			e2 = v2 / n[2, key]
+
+			# Welch t-test, slower is the direction of interest
+			if(0 == e1 + e2) {
+				p = 0
+				if(m2 <= m1) p = 1
+			}
+			else {
+				t = (m2 - m1) / sqrt(e1 + e2)
+				df = (e1 + e2) * (e1 + e2) / (e1 * e1 / (n[1, key] - 1) + e2 * e2 / (n[2, key] - 1) + 1e-300)
+				p = upper_tail(t, df)
+			}
+
+			change = 0
+			if(0 < m1) change = 100 * (m2 - m1) / m1
+			mark = ""
+			if((change > threshold) && (p < alpha)) {
+				mark = "  REGRESSION"
+				status = 1
+			}
+			printf "%-40s %14.3f %14.3f %8.1f%% %9.4f%s\n", key, m1 / 1e6, m2 / 1e6, change, p, mark
+		}
+		print "status", status > "/dev/stderr"
+	}
+' "$baseline" "$samples" > "$work/report" 2> "$work/status"
+
+printf "%-40s %14s %14s %9s %9s\n" "link phase" "baseline ms" "current ms" "change" "p"
+sort "$work/report"
+[ "status 0" = "$(cat "$work/status")" ]
@@ -0,0 +1,590 @@
+/* Copyright (C) 2020 Jeremiah Orians
+ * This file is part of M3-Meteoroid.
+ *
+ * M3-Meteoroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * M3-Meteoroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Writes x86 ELF32 relocatable objects of any size for scaling runs.
+ * Every object has a .text of functions and a .data of words. Each
+ * function calls functions in other objects (R_386_PC32) and loads
+ * words from its own .data (R_386_32), then returns. The link resolves
+ * but the program is not meant to be run. With --function-sections each
+ * function gets its own section, as -ffunction-sections would, so enough
+ * functions go past SHN_LORESERVE into extended section numbering.
+ * Alongside the objects a corpus.txt is written for bench/bench-compare.sh. */
+
+#include "../gcc_req.h"
+#include <string.h>
+
+// CONSTANT FALSE 0
+#define FALSE 0
+// CONSTANT TRUE 1
+#define TRUE 1
+// CONSTANT SECTIONS 7
+#define SECTIONS 7
+// CONSTANT NAME_SIZE 24
+#define NAME_SIZE 24
+// CONSTANT FIXED_SECTIONS 5
+#define FIXED_SECTIONS 5
+// CONSTANT LORESERVE 0xFF00
+#define LORESERVE 0xFF00
+// CONSTANT XINDEX 0xFFFF
+#define XINDEX 0xFFFF
+
+int match(char* a, char* b);
+void file_print(char* s, FILE* f);
+void require(int bool, char* error);
+int numerate_string(char *a);
+
+struct buffer
+{
+	char* contents;
+	SCM size;
+};
+
+SCM files;
+SCM functions;
+SCM data;
+SCM calls;
+SCM loads;
+SCM seed;
+int function_sections;
+char* directory;
+
+struct buffer* new_buffer(SCM capacity)
+{
+	struct buffer* r = calloc(1, sizeof(struct buffer));
+	r->contents = calloc(capacity + 1, sizeof(char));
+	return r;
+}
+
+void put_byte(struct buffer* b, int c)
+{
+	b->contents[b->size] = c;
+	b->size = b->size + 1;
+}
+
+void put_half(struct buffer* b, int value)
+{
+	put_byte(b, value & 0xFF);
+	put_byte(b, (value >> 8) & 0xFF);
+}
+
+void put_word(struct buffer* b, SCM value)
+{
+	put_half(b, value & 0xFFFF);
+	put_half(b, (value >> 16) & 0xFFFF);
+}
+
+void put_string(struct buffer* b, char* s)
+{
+	/* Includes the terminating NUL */
+	int i = 0;
+	while(0 != s[i])
+	{
+		put_byte(b, s[i]);
+		i = i + 1;
+	}
+	put_byte(b, 0);
+}
+
+char* number_string(SCM n, char* s)
+{
+	/* Writes n in decimal at s and returns the end */
+	if(10 <= n) s = number_string(n / 10, s);
+	s[0] = '0' + (n % 10);
+	return s + 1;
+}
+
+char* symbol_name(int kind, SCM file, SCM index)
+{
+	/* f_<file>_<index> for functions, d_<file>_<index> for data */
+	char* r = calloc(NAME_SIZE, sizeof(char));
+	r[0] = kind;
+	r[1] = '_';
+	char* s = number_string(file, r + 2);
+	s[0] = '_';
+	number_string(index, s + 1);
+	return r;
+}
+
+SCM next_random()
+{
+	/* Same seed, same corpus */
+	seed = ((seed * 1103515245) + 12345) & 0x7FFFFFFF;
+	return seed >> 8;
+}
+
+void put_symbol_section(struct buffer* symtab, struct buffer* shndx, SCM section)
+{
+	/* Sections past SHN_LORESERVE are named in .symtab_shndx instead */
+	if(NULL != shndx)
+	{
+		if(LORESERVE <= section)
+		{
+			put_half(symtab, XINDEX);
+			put_word(shndx, section);
+			return;
+		}
+		put_word(shndx, 0);
+	}
+	put_half(symtab, section);
+}
+
+/* Undefined symbols are shared by every call to the same function, found through an open hash */
+SCM* undefined_keys;
+SCM* undefined_symbols;
+SCM undefined_size;
+
+SCM undefined_symbol(SCM key, SCM next_symbol, struct buffer* symtab, struct buffer* shndx, struct buffer* strtab, SCM file, SCM index)
+{
+	SCM slot = (key * 2654435761) & (undefined_size - 1);
+	while(0 != undefined_keys[slot])
+	{
+		if(key + 1 == undefined_keys[slot]) return undefined_symbols[slot];
+		slot = (slot + 1) & (undefined_size - 1);
+	}
+	undefined_keys[slot] = key + 1;
+	undefined_symbols[slot] = next_symbol;
+
+	/* STB_GLOBAL with STT_NOTYPE in SHN_UNDEF */
+	put_word(symtab, strtab->size);
+	put_word(symtab, 0);
+	put_word(symtab, 0);
+	put_byte(symtab, 0x10);
+	put_byte(symtab, 0);
+	put_symbol_section(symtab, shndx, 0);
+	put_string(strtab, symbol_name('f', file, index));
+	return next_symbol;
+}
+
+void put_section_header(struct buffer* b, SCM name, SCM type, SCM flags, SCM offset, SCM size, SCM link, SCM info, SCM align, SCM entry_size)
+{
+	put_word(b, name);
+	put_word(b, type);
+	put_word(b, flags);
+	put_word(b, 0);
+	put_word(b, offset);
+	put_word(b, size);
+	put_word(b, link);
+	put_word(b, info);
+	put_word(b, align);
+	put_word(b, entry_size);
+}
+
+void put_section_name(struct buffer* b, char* prefix, char* name)
+{
+	int i = 0;
+	while(0 != prefix[i])
+	{
+		put_byte(b, prefix[i]);
+		i = i + 1;
+	}
+	put_string(b, name);
+}
+
+SCM text_section(SCM function)
+{
+	/* .text.<function> and its .rel.text.<function> follow the fixed sections */
+	if(function_sections) return FIXED_SECTIONS + (2 * function);
+	return 1;
+}
+
+SCM data_section()
+{
+	if(function_sections) return 1;
+	return 2;
+}
+
+void write_buffer(struct buffer* b, FILE* f)
+{
+	require(b->size == (SCM) fwrite(b->contents, sizeof(char), b->size, f), "Unable to write object\n");
+}
+
+void pad_to(SCM* offset, SCM alignment, FILE* f)
+{
+	while(0 != (offset[0] & (alignment - 1)))
+	{
+		fputc(0, f);
+		offset[0] = offset[0] + 1;
+	}
+}
+
+void write_object(SCM file, FILE* f)
+{
+	SCM references = functions * (calls + loads);
+	SCM function_size = 1 + ((calls + loads) * 5);
+	SCM symbols = 1 + functions + data + (functions * calls);
+	struct buffer* text = new_buffer(functions * function_size);
+	struct buffer* words = new_buffer(data * 4);
+	struct buffer* rel = new_buffer(references * 8);
+	struct buffer* symtab = new_buffer(symbols * 16);
+	struct buffer* strtab = new_buffer(1 + ((functions + data + (functions * calls)) * NAME_SIZE));
+	struct buffer* shstrtab = new_buffer(64);
+	struct buffer* shndx = NULL;
+	SCM sections = SECTIONS;
+	if(function_sections)
+	{
+		shndx = new_buffer(symbols * 4);
+		shstrtab = new_buffer(64 + (functions * 2 * (10 + NAME_SIZE)));
+		sections = FIXED_SECTIONS + (2 * functions) + 1;
+	}
+
+	undefined_size = 1;
+	while(undefined_size < 2 * (functions * calls + 1)) undefined_size = undefined_size * 2;
+	undefined_keys = calloc(undefined_size, sizeof(SCM));
+	undefined_symbols = calloc(undefined_size, sizeof(SCM));
+
+	/* Symbol 0 is all zeros, the definitions come next so their indexes are known */
+	SCM i;
+	for(i = 0; i < 14; i = i + 1) put_byte(symtab, 0);
+	put_symbol_section(symtab, shndx, 0);
+	put_byte(strtab, 0);
+	for(i = 0; i < functions; i = i + 1)
+	{
+		/* STB_GLOBAL with STT_FUNC in .text */
+		put_word(symtab, strtab->size);
+		if(function_sections) put_word(symtab, 0);
+		else put_word(symtab, i * function_size);
+		put_word(symtab, function_size);
+		put_byte(symtab, 0x12);
+		put_byte(symtab, 0);
+		put_symbol_section(symtab, shndx, text_section(i));
+		put_string(strtab, symbol_name('f', file, i));
+	}
+	for(i = 0; i < data; i = i + 1)
+	{
+		/* STB_GLOBAL with STT_OBJECT in .data */
+		put_word(symtab, strtab->size);
+		put_word(symtab, i * 4);
+		put_word(symtab, 4);
+		put_byte(symtab, 0x11);
+		put_byte(symtab, 0);
+		put_symbol_section(symtab, shndx, data_section());
+		put_string(strtab, symbol_name('d', file, i));
+		put_word(words, (file << 16) + i);
+	}
+
+	SCM next_symbol = 1 + functions + data;
+	SCM symbol;
+	SCM target_file;
+	SCM target;
+	SCM j;
+	SCM base = 0;
+	for(i = 0; i < functions; i = i + 1)
+	{
+		/* With a section per function, offsets are from the start of the function */
+		if(function_sections) base = text->size;
+		for(j = 0; j < calls; j = j + 1)
+		{
+			/* call rel32 to a function in another object, the addend of -4 is in place */
+			target_file = next_random() % files;
+			if((target_file == file) && (1 < files)) target_file = (target_file + 1) % files;
+			target = next_random() % functions;
+			if(target_file == file) symbol = 1 + target;
+			else
+			{
+				symbol = undefined_symbol((target_file * functions) + target, next_symbol, symtab, shndx, strtab, target_file, target);
+				if(symbol == next_symbol) next_symbol = next_symbol + 1;
+			}
+			put_word(rel, text->size + 1 - base);
+			put_word(rel, (symbol << 8) + 2);
+			put_byte(text, 0xE8);
+			put_word(text, -4);
+		}
+		for(j = 0; j < loads; j = j + 1)
+		{
+			/* mov eax, [word] */
+			put_word(rel, text->size + 1 - base);
+			put_word(rel, ((1 + functions + (next_random() % data)) << 8) + 1);
+			put_byte(text, 0xA1);
+			put_word(text, 0);
+		}
+		put_byte(text, 0xC3);
+	}
+
+	/* Section names */
+	put_byte(shstrtab, 0);
+	SCM text_name = shstrtab->size;
+	put_string(shstrtab, ".text");
+	SCM data_name = shstrtab->size;
+	put_string(shstrtab, ".data");
+	SCM rel_name = shstrtab->size;
+	put_string(shstrtab, ".rel.text");
+	SCM symtab_name = shstrtab->size;
+	put_string(shstrtab, ".symtab");
+	SCM strtab_name = shstrtab->size;
+	put_string(shstrtab, ".strtab");
+	SCM shstrtab_name = shstrtab->size;
+	put_string(shstrtab, ".shstrtab");
+	SCM shndx_name = shstrtab->size;
+	if(function_sections) put_string(shstrtab, ".symtab_shndx");
+	SCM function_names = shstrtab->size;
+	if(function_sections)
+	{
+		for(i = 0; i < functions; i = i + 1)
+		{
+			put_section_name(shstrtab, ".rel.text.", symbol_name('f', file, i));
+		}
+	}
+
+	/* ELF header, then the sections in order, then the section headers */
+	SCM text_offset = 52;
+	SCM data_offset = text_offset + text->size;
+	data_offset = (data_offset + 3) & ~3;
+	SCM rel_offset = data_offset + words->size;
+	SCM symtab_offset = rel_offset + rel->size;
+	SCM strtab_offset = symtab_offset + symtab->size;
+	SCM shndx_offset = strtab_offset + strtab->size;
+	SCM shstrtab_offset = shndx_offset;
+	if(function_sections) shstrtab_offset = shndx_offset + shndx->size;
+	SCM headers = (shstrtab_offset + shstrtab->size + 3) & ~3;
+
+	/* Past SHN_LORESERVE sections the counts move into section header 0 */
+	SCM shnum = sections;
+	SCM shstrndx = sections - 1;
+	SCM extended_size = 0;
+	SCM extended_link = 0;
+	if(LORESERVE <= shnum)
+	{
+		extended_size = shnum;
+		shnum = 0;
+	}
+	if(LORESERVE <= shstrndx)
+	{
+		extended_link = shstrndx;
+		shstrndx = XINDEX;
+	}
+
+	struct buffer* h = new_buffer(52);
+	put_byte(h, 0x7F);
+	put_byte(h, 'E');
+	put_byte(h, 'L');
+	put_byte(h, 'F');
+	/* ELFCLASS32, ELFDATA2LSB, EV_CURRENT */
+	put_byte(h, 1);
+	put_byte(h, 1);
+	put_byte(h, 1);
+	for(i = 7; i < 16; i = i + 1) put_byte(h, 0);
+	/* ET_REL for EM_386 */
+	put_half(h, 1);
+	put_half(h, 3);
+	put_word(h, 1);
+	put_word(h, 0);
+	put_word(h, 0);
+	put_word(h, headers);
+	put_word(h, 0);
+	put_half(h, 52);
+	put_half(h, 0);
+	put_half(h, 0);
+	put_half(h, 40);
+	put_half(h, shnum);
+	put_half(h, shstrndx);
+
+	struct buffer* sh = new_buffer(sections * 40);
+	put_section_header(sh, 0, 0, 0, 0, extended_size, extended_link, 0, 0, 0);
+	if(function_sections)
+	{
+		put_section_header(sh, data_name, 1, 3, data_offset, words->size, 0, 0, 4, 0);
+		/* Only the null symbol is local */
+		put_section_header(sh, symtab_name, 2, 0, symtab_offset, symtab->size, 3, 1, 4, 16);
+		put_section_header(sh, strtab_name, 3, 0, strtab_offset, strtab->size, 0, 0, 1, 0);
+		/* SHT_SYMTAB_SHNDX for .symtab */
+		put_section_header(sh, shndx_name, 18, 0, shndx_offset, shndx->size, 2, 0, 4, 4);
+		SCM name = function_names;
+		SCM relocations = (calls + loads) * 8;
+		for(i = 0; i < functions; i = i + 1)
+		{
+			/* .text.<function> shares the tail of the .rel.text.<function> name */
+			put_section_header(sh, name + 4, 1, 6, text_offset + (i * function_size), function_size, 0, 0, 1, 0);
+			put_section_header(sh, name, 9, 0x40, rel_offset + (i * relocations), relocations, 2, text_section(i), 4, 8);
+			while(0 != shstrtab->contents[name]) name = name + 1;
+			name = name + 1;
+		}
+	}
+	else
+	{
+		put_section_header(sh, text_name, 1, 6, text_offset, text->size, 0, 0, 1, 0);
+		put_section_header(sh, data_name, 1, 3, data_offset, words->size, 0, 0, 4, 0);
+		put_section_header(sh, rel_name, 9, 0x40, rel_offset, rel->size, 4, 1, 4, 8);
+		/* Only the null symbol is local */
+		put_section_header(sh, symtab_name, 2, 0, symtab_offset, symtab->size, 5, 1, 4, 16);
+		put_section_header(sh, strtab_name, 3, 0, strtab_offset, strtab->size, 0, 0, 1, 0);
+	}
+	put_section_header(sh, shstrtab_name, 3, 0, shstrtab_offset, shstrtab->size, 0, 0, 1, 0);
+
+	SCM offset = 0;
+	write_buffer(h, f);
+	write_buffer(text, f);
+	offset = text_offset + text->size;
+	pad_to(&offset, 4, f);
+	write_buffer(words, f);
+	write_buffer(rel, f);
+	write_buffer(symtab, f);
+	write_buffer(strtab, f);
+	if(function_sections) write_buffer(shndx, f);
+	write_buffer(shstrtab, f);
+	offset = shstrtab_offset + shstrtab->size;
+	pad_to(&offset, 4, f);
+	write_buffer(sh, f);
+
+	free(text->contents);
+	free(words->contents);
+	free(rel->contents);
+	free(symtab->contents);
+	free(strtab->contents);
+	if(function_sections) free(shndx->contents);
+	free(undefined_keys);
+	free(undefined_symbols);
+}
+
+char* object_name(SCM file)
+{
+	char* r = calloc(NAME_SIZE, sizeof(char));
+	r[0] = 'o';
+	r[1] = 'b';
+	r[2] = 'j';
+	char* s = number_string(file, r + 3);
+	s[0] = '.';
+	s[1] = 'o';
+	return r;
+}
+
+char* path_name(char* name)
+{
+	char* r = calloc(strlen(directory) + strlen(name) + 2, sizeof(char));
+	strcpy(r, directory);
+	strcat(r, "/");
+	strcat(r, name);
+	return r;
+}
+
+FILE* open_output(char* name)
+{
+	FILE* f = fopen(path_name(name), "w");
+	if(NULL == f)
+	{
+		file_print("Unable to open for writing file: ", stderr);
+		file_print(path_name(name), stderr);
+		file_print("\n Aborting to avoid problems\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	return f;
+}
+
+SCM count_argument(char* value, char* error)
+{
+	require(NULL != value, error);
+	return numerate_string(value);
+}
+
+int main(int argc, char** argv)
+{
+	files = 10;
+	functions = 100;
+	data = 100;
+	calls = 2;
+	loads = 4;
+	seed = 1;
+	function_sections = FALSE;
+	directory = ".";
+
+	int i = 1;
+	while(i < argc)
+	{
+		if(match(argv[i], "--files"))
+		{
+			files = count_argument(argv[i + 1], "--files needs a count\n");
+			i = i + 2;
+		}
+		else if(match(argv[i], "--functions"))
+		{
+			functions = count_argument(argv[i + 1], "--functions needs a count\n");
+			i = i + 2;
+		}
+		else if(match(argv[i], "--data"))
+		{
+			data = count_argument(argv[i + 1], "--data needs a count\n");
+			i = i + 2;
+		}
+		else if(match(argv[i], "--calls"))
+		{
+			calls = count_argument(argv[i + 1], "--calls needs a count\n");
+			i = i + 2;
+		}
+		else if(match(argv[i], "--loads"))
+		{
+			loads = count_argument(argv[i + 1], "--loads needs a count\n");
+			i = i + 2;
+		}
+		else if(match(argv[i], "--seed"))
+		{
+			seed = count_argument(argv[i + 1], "--seed needs a number\n");
+			i = i + 2;
+		}
+		else if(match(argv[i], "--function-sections"))
+		{
+			function_sections = TRUE;
+			i = i + 1;
+		}
+		else if(match(argv[i], "-o") || match(argv[i], "--output"))
+		{
+			require(NULL != argv[i + 1], "--output needs a directory\n");
+			directory = argv[i + 1];
+			i = i + 2;
+		}
+		else if(match(argv[i], "-h") || match(argv[i], "--help"))
+		{
+			file_print("--files $count objects to write, 10 by default\n", stdout);
+			file_print("--functions $count functions in each object, 100 by default\n", stdout);
+			file_print("--data $count data words in each object, 100 by default\n", stdout);
+			file_print("--calls $count calls from each function into other objects, 2 by default\n", stdout);
+			file_print("--loads $count loads of data words in each function, 4 by default\n", stdout);
+			file_print("--seed $number to pick a different set of references\n", stdout);
+			file_print("--function-sections to give every function its own .text and .rel.text, past 65280 sections this uses SHN_XINDEX\n", stdout);
+			file_print("--output $directory to write obj*.o and corpus.txt to, which must exist\n", stdout);
+			exit(EXIT_SUCCESS);
+		}
+		else
+		{
+			file_print("UNKNOWN ARGUMENT\n", stdout);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	require(0 < files, "--files must be at least 1\n");
+	require(0 < functions, "--functions must be at least 1\n");
+	require((0 < data) || (0 == loads), "--loads needs at least one data word\n");
+
+	/* One link of every object, for bench/bench-compare.sh */
+	FILE* corpus = open_output("corpus.txt");
+	file_print("synthetic:", corpus);
+
+	SCM file;
+	FILE* f;
+	char* name;
+	for(file = 0; file < files; file = file + 1)
+	{
+		name = object_name(file);
+		f = open_output(name);
+		write_object(file, f);
+		fclose(f);
+		file_print(" -f ", corpus);
+		file_print(name, corpus);
+	}
+	file_print("\n", corpus);
+	fclose(corpus);
+
+	return EXIT_SUCCESS;
+}
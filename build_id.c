@@ -0,0 +1,219 @@
+/* Copyright (C) 2020 Jeremiah Orians
+ * This file is part of M3-Meteoroid.
+ *
+ * M3-Meteoroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * M3-Meteoroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Meteoroid.h"
+
+// CONSTANT BUILD_ID_SIZE 20
+#define BUILD_ID_SIZE 20
+// CONSTANT BUILD_ID_CHUNK 1048576
+#define BUILD_ID_CHUNK 1048576
+
+void put_char(int c, struct segment* f);
+void write_word(struct segment* f, SCM o);
+struct segment* map_debug_sections(int fd);
+void unmap_debug_sections(struct segment* debug);
+
+SCM sha1_rotate(SCM x, int n)
+{
+	/* Masking keeps this correct even where SCM is only 32bits */
+	return ((x << n) | ((x >> (32 - n)) & ((1 << n) - 1))) & 0xFFFFFFFF;
+}
+
+void sha1_block(SCM* h, SCM* w, char* block)
+{
+	int i;
+	for(i = 0; i < 16; i = i + 1)
+	{
+		w[i] = ((block[4 * i] & 0xFF) << 24) + ((block[4 * i + 1] & 0xFF) << 16) + ((block[4 * i + 2] & 0xFF) << 8) + (block[4 * i + 3] & 0xFF);
+		w[i] = w[i] & 0xFFFFFFFF;
+	}
+	for(i = 16; i < 80; i = i + 1)
+	{
+		w[i] = sha1_rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	}
+
+	SCM a = h[0];
+	SCM b = h[1];
+	SCM c = h[2];
+	SCM d = h[3];
+	SCM e = h[4];
+	SCM f;
+	SCM k;
+	SCM t;
+	for(i = 0; i < 80; i = i + 1)
+	{
+		if(20 > i)
+		{
+			f = (b & c) | ((~b) & d);
+			k = 0x5A827999;
+		}
+		else if(40 > i)
+		{
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		}
+		else if(60 > i)
+		{
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+
+		t = (sha1_rotate(a, 5) + (f & 0xFFFFFFFF) + e + k + w[i]) & 0xFFFFFFFF;
+		e = d;
+		d = c;
+		c = sha1_rotate(b, 30);
+		b = a;
+		a = t;
+	}
+
+	h[0] = (h[0] + a) & 0xFFFFFFFF;
+	h[1] = (h[1] + b) & 0xFFFFFFFF;
+	h[2] = (h[2] + c) & 0xFFFFFFFF;
+	h[3] = (h[3] + d) & 0xFFFFFFFF;
+	h[4] = (h[4] + e) & 0xFFFFFFFF;
+}
+
+void sha1(char* data, SCM size, char* digest)
+{
+	SCM* h = calloc(5, sizeof(SCM));
+	SCM* w = calloc(80, sizeof(SCM));
+	char* block = calloc(64, sizeof(char));
+	h[0] = 0x67452301;
+	h[1] = 0xEFCDAB89;
+	h[2] = 0x98BADCFE;
+	h[3] = 0x10325476;
+	h[4] = 0xC3D2E1F0;
+
+	/* Whole blocks straight from the data */
+	SCM i = 0;
+	while(i + 64 <= size)
+	{
+		sha1_block(h, w, data + i);
+		i = i + 64;
+	}
+
+	/* The tail, a 1 bit and the length in bits fill one or two more blocks */
+	int j = 0;
+	while(i < size)
+	{
+		block[j] = data[i];
+		i = i + 1;
+		j = j + 1;
+	}
+	block[j] = 0x80;
+	if(56 <= j + 1)
+	{
+		sha1_block(h, w, block);
+		for(j = 0; j < 64; j = j + 1) block[j] = 0;
+	}
+	else
+	{
+		for(j = j + 1; j < 64; j = j + 1) block[j] = 0;
+	}
+
+	SCM bits = size << 3;
+	for(j = 63; j >= 56; j = j - 1)
+	{
+		block[j] = bits & 0xFF;
+		bits = bits >> 8;
+	}
+	sha1_block(h, w, block);
+
+	for(j = 0; j < 5; j = j + 1)
+	{
+		digest[4 * j] = (h[j] >> 24) & 0xFF;
+		digest[4 * j + 1] = (h[j] >> 16) & 0xFF;
+		digest[4 * j + 2] = (h[j] >> 8) & 0xFF;
+		digest[4 * j + 3] = h[j] & 0xFF;
+	}
+
+	free(h);
+	free(w);
+	free(block);
+}
+
+SCM build_id_note_size()
+{
+	if(!BuildID) return 0;
+	/* namesz, descsz, type, "GNU\0" and the hash */
+	return 12 + 4 + BUILD_ID_SIZE;
+}
+
+void write_build_id_note(struct segment* f, SCM offset)
+{
+	write_offset = offset;
+	write_word(f, 4);
+	write_word(f, BUILD_ID_SIZE);
+	/* NT_GNU_BUILD_ID */
+	write_word(f, 3);
+	put_char('G', f);
+	put_char('N', f);
+	put_char('U', f);
+	put_char(0, f);
+	/* The hash itself is filled in by generate_build_id once the image is done */
+}
+
+SCM count_chunks(SCM size)
+{
+	return (size + BUILD_ID_CHUNK - 1) / BUILD_ID_CHUNK;
+}
+
+char* hash_chunks(char* contents, SCM total, char* leaves)
+{
+	SCM i;
+	SCM size;
+	for(i = 0; i < count_chunks(total); i = i + 1)
+	{
+		size = total - (i * BUILD_ID_CHUNK);
+		if(BUILD_ID_CHUNK < size) size = BUILD_ID_CHUNK;
+		sha1(contents + (i * BUILD_ID_CHUNK), size, leaves);
+		leaves = leaves + BUILD_ID_SIZE;
+	}
+	return leaves;
+}
+
+void generate_build_id(struct segment* f, SCM offset, int fd)
+{
+	/* Each chunk is hashed on its own and the root hash covers the chunk
+	 * hashes, so no chunk depends on any other one */
+	SCM chunks = count_chunks(f->size);
+
+	/* Passed through debug sections are after the mapping, so they are hashed from a mapping of their own */
+	struct output_section* o;
+	for(o = debug_sections; (NULL != o) && (NULL != o->pieces); o = o->next)
+	{
+		chunks = chunks + count_chunks(o->size);
+	}
+
+	char* leaves = calloc(chunks * BUILD_ID_SIZE + 1, sizeof(char));
+	char* next = hash_chunks(f->contents, f->size, leaves);
+	struct segment* debug = map_debug_sections(fd);
+	for(o = debug_sections; (NULL != o) && (NULL != o->pieces); o = o->next)
+	{
+		next = hash_chunks(debug->contents + o->offset - debug->starting_address, o->size, next);
+	}
+	unmap_debug_sections(debug);
+
+	/* The note's hash bytes were still zero while the leaves were hashed */
+	sha1(leaves, chunks * BUILD_ID_SIZE, f->contents + offset + 16);
+	free(leaves);
+}
@@ -0,0 +1,377 @@
+/* Copyright (C) 2020 Jeremiah Orians
+ * This file is part of M3-Meteoroid.
+ *
+ * M3-Meteoroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * M3-Meteoroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Meteoroid.h"
+#include <unistd.h>
+
+// CONSTANT COMPRESS_CHUNK 1048576
+#define COMPRESS_CHUNK 1048576
+// CONSTANT DEFLATE_WINDOW 32768
+#define DEFLATE_WINDOW 32768
+// CONSTANT DEFLATE_HASH 32768
+#define DEFLATE_HASH 32768
+// CONSTANT DEFLATE_CHAIN 32
+#define DEFLATE_CHAIN 32
+// CONSTANT SHF_COMPRESSED 0x800
+#define SHF_COMPRESSED 0x800
+
+void write_word(struct segment* f, SCM o);
+void write_register(struct segment* f, SCM o);
+void write_section_header(struct segment* f, struct output_section* s);
+SCM section_header_size();
+SCM align_up(SCM address, SCM alignment);
+
+/* --compress-debug-sections writes each .debug_* output section as an
+ * ELFCOMPRESS_ZLIB section. The deflate stream only uses the fixed Huffman
+ * codes and is built from 1MB chunks that never refer back into an earlier
+ * chunk, so every chunk is read, compressed and written on its own and only
+ * one chunk of a section is ever held in memory. */
+
+int* length_base;
+int* length_extra;
+int* distance_base;
+int* distance_extra;
+
+void setup_deflate_tables()
+{
+	if(NULL != length_base) return;
+	length_base = calloc(29, sizeof(int));
+	length_extra = calloc(29, sizeof(int));
+	distance_base = calloc(30, sizeof(int));
+	distance_extra = calloc(30, sizeof(int));
+
+	/* Lengths 257 to 284 double their extra bits every four codes, 285 is 258 on its own */
+	int i;
+	length_base[0] = 3;
+	for(i = 0; i < 28; i = i + 1)
+	{
+		if(8 <= i) length_extra[i] = (i - 4) >> 2;
+		if(27 > i) length_base[i + 1] = length_base[i] + (1 << length_extra[i]);
+	}
+	length_base[28] = 258;
+
+	/* Distances do the same every two codes */
+	distance_base[0] = 1;
+	for(i = 0; i < 30; i = i + 1)
+	{
+		if(4 <= i) distance_extra[i] = (i - 2) >> 1;
+		if(29 > i) distance_base[i + 1] = distance_base[i] + (1 << distance_extra[i]);
+	}
+}
+
+void put_bits(struct deflate_stream* z, SCM value, int count)
+{
+	/* Deflate packs bits starting from the least significant one */
+	int i;
+	for(i = 0; i < count; i = i + 1)
+	{
+		z->bits = z->bits | (((value >> i) & 1) << z->count);
+		z->count = z->count + 1;
+		if(8 == z->count)
+		{
+			z->contents[z->size] = z->bits;
+			z->size = z->size + 1;
+			z->bits = 0;
+			z->count = 0;
+		}
+	}
+}
+
+void put_huffman(struct deflate_stream* z, SCM code, int length)
+{
+	/* Huffman codes are the exception, they go most significant bit first */
+	int i;
+	for(i = length - 1; i >= 0; i = i - 1) put_bits(z, (code >> i) & 1, 1);
+}
+
+void put_fixed_symbol(struct deflate_stream* z, int symbol)
+{
+	if(144 > symbol) put_huffman(z, 0x30 + symbol, 8);
+	else if(256 > symbol) put_huffman(z, 0x190 + symbol - 144, 9);
+	else if(280 > symbol) put_huffman(z, symbol - 256, 7);
+	else put_huffman(z, 0xC0 + symbol - 280, 8);
+}
+
+void put_match(struct deflate_stream* z, int length, int distance)
+{
+	int code = 28;
+	while(length_base[code] > length) code = code - 1;
+	put_fixed_symbol(z, 257 + code);
+	put_bits(z, length - length_base[code], length_extra[code]);
+
+	code = 29;
+	while(distance_base[code] > distance) code = code - 1;
+	put_huffman(z, code, 5);
+	put_bits(z, distance - distance_base[code], distance_extra[code]);
+}
+
+void flush_bits(struct deflate_stream* z)
+{
+	if(0 != z->count) put_bits(z, 0, 8 - z->count);
+}
+
+int deflate_hash(char* c)
+{
+	return (((c[0] & 0xFF) << 10) ^ ((c[1] & 0xFF) << 5) ^ (c[2] & 0xFF)) & (DEFLATE_HASH - 1);
+}
+
+void deflate_chunk(struct deflate_stream* z, char* c, SCM size, int last, int* head, int* prev)
+{
+	/* Positions are stored plus one so that zero means none */
+	SCM i;
+	for(i = 0; i < DEFLATE_HASH; i = i + 1) head[i] = 0;
+
+	/* One fixed Huffman block per chunk */
+	put_bits(z, last, 1);
+	put_bits(z, 1, 2);
+
+	SCM pos = 0;
+	int best;
+	int best_distance;
+	int length;
+	int limit;
+	int chain;
+	SCM candidate;
+	int h;
+	while(pos < size)
+	{
+		best = 0;
+		best_distance = 0;
+		if(pos + 2 < size)
+		{
+			limit = 258;
+			if(size - pos < limit) limit = size - pos;
+			h = deflate_hash(c + pos);
+			candidate = head[h] - 1;
+			chain = 0;
+			while((0 <= candidate) && (DEFLATE_WINDOW >= pos - candidate) && (DEFLATE_CHAIN > chain))
+			{
+				length = 0;
+				while((length < limit) && (c[candidate + length] == c[pos + length])) length = length + 1;
+				if(length > best)
+				{
+					best = length;
+					best_distance = pos - candidate;
+				}
+				candidate = prev[candidate] - 1;
+				chain = chain + 1;
+			}
+			prev[pos] = head[h];
+			head[h] = pos + 1;
+		}
+
+		if(3 <= best)
+		{
+			put_match(z, best, best_distance);
+
+			/* The bytes inside the match can still start later matches */
+			for(i = pos + 1; i < pos + best; i = i + 1)
+			{
+				if(i + 2 < size)
+				{
+					h = deflate_hash(c + i);
+					prev[i] = head[h];
+					head[h] = i + 1;
+				}
+			}
+			pos = pos + best;
+		}
+		else
+		{
+			put_fixed_symbol(z, c[pos] & 0xFF);
+			pos = pos + 1;
+		}
+	}
+	put_fixed_symbol(z, 256);
+
+	/* An empty stored block brings the next chunk back to a byte boundary */
+	if(!last)
+	{
+		put_bits(z, 0, 3);
+		flush_bits(z);
+		put_bits(z, 0, 16);
+		put_bits(z, 0xFFFF, 16);
+	}
+}
+
+SCM adler32(SCM check, char* c, SCM size)
+{
+	/* Carried on from chunk to chunk, it starts at 1 */
+	SCM a = check & 0xFFFF;
+	SCM b = (check >> 16) & 0xFFFF;
+	SCM i;
+	for(i = 0; i < size; i = i + 1)
+	{
+		a = (a + (c[i] & 0xFF)) % 65521;
+		b = (b + a) % 65521;
+	}
+	return (b << 16) | a;
+}
+
+SCM write_deflate_stream(struct deflate_stream* z, int fd, SCM offset)
+{
+	/* Only whole bytes are written, the bits still being packed stay behind */
+	require(z->size == pwrite(fd, z->contents, z->size, offset), "Unable to write a compressed debug section\n");
+	offset = offset + z->size;
+	z->size = 0;
+	return offset;
+}
+
+SCM zlib_compress(int fd, SCM from, SCM size, SCM to)
+{
+	/* Fixed codes are at most 9 bits a byte, plus the block headers */
+	struct deflate_stream* z = calloc(1, sizeof(struct deflate_stream));
+	z->contents = calloc(COMPRESS_CHUNK + (COMPRESS_CHUNK >> 3) + 16, sizeof(char));
+	char* c = calloc(COMPRESS_CHUNK, sizeof(char));
+	int* head = calloc(DEFLATE_HASH, sizeof(int));
+	int* prev = calloc(COMPRESS_CHUNK, sizeof(int));
+	setup_deflate_tables();
+
+	/* CM 8 with a 32K window, FLEVEL 0 and the check bits */
+	put_bits(z, 0x78, 8);
+	put_bits(z, 0x01, 8);
+
+	/* Each chunk is read, deflated and written before the next one is read */
+	SCM offset = 0;
+	SCM chunk;
+	SCM check = 1;
+	int last = FALSE;
+	while(!last)
+	{
+		chunk = size - offset;
+		if(COMPRESS_CHUNK < chunk) chunk = COMPRESS_CHUNK;
+		last = (offset + chunk) >= size;
+		require(chunk == pread(fd, c, chunk, from + offset), "Unable to read back a debug section to compress it\n");
+		check = adler32(check, c, chunk);
+		deflate_chunk(z, c, chunk, last, head, prev);
+		if(!last) to = write_deflate_stream(z, fd, to);
+		offset = offset + chunk;
+	}
+	flush_bits(z);
+
+	/* Adler-32 of the uncompressed bytes, most significant byte first */
+	put_bits(z, (check >> 24) & 0xFF, 8);
+	put_bits(z, (check >> 16) & 0xFF, 8);
+	put_bits(z, (check >> 8) & 0xFF, 8);
+	put_bits(z, check & 0xFF, 8);
+	to = write_deflate_stream(z, fd, to);
+
+	free(z->contents);
+	free(z);
+	free(c);
+	free(head);
+	free(prev);
+	return to;
+}
+
+void move_file_bytes(int fd, SCM from, SCM size, SCM to)
+{
+	/* Front to back a chunk at a time, which is safe as long as the bytes move down */
+	char* c = calloc(COMPRESS_CHUNK, sizeof(char));
+	SCM offset = 0;
+	SCM chunk;
+	while(offset < size)
+	{
+		chunk = size - offset;
+		if(COMPRESS_CHUNK < chunk) chunk = COMPRESS_CHUNK;
+		require(chunk == pread(fd, c, chunk, from + offset), "Unable to read back a debug section\n");
+		require(chunk == pwrite(fd, c, chunk, to + offset), "Unable to move a debug section\n");
+		offset = offset + chunk;
+	}
+	free(c);
+}
+
+SCM compression_header_size()
+{
+	if(largeint) return 24;
+	return 12;
+}
+
+SCM compress_debug_section(struct output_section* o, int fd, SCM offset, SCM scratch)
+{
+	/* Compressed past the end of the file first, so the section is still whole if it is not worth it */
+	SCM compressed = zlib_compress(fd, o->offset, o->size, scratch) - scratch;
+	SCM header = compression_header_size();
+	SCM alignment = 4;
+	if(largeint) alignment = 8;
+	SCM start = align_up(offset, alignment);
+
+	/* Not worth it, or it would run into the next section before that is read */
+	if(start + header + compressed >= o->offset + o->size)
+	{
+		start = align_up(offset, o->alignment);
+		move_file_bytes(fd, o->offset, o->size, start);
+	}
+	else
+	{
+		/* Elf_Chdr with ELFCOMPRESS_ZLIB */
+		struct segment* h = calloc(1, sizeof(struct segment));
+		h->size = header;
+		h->contents = calloc(header, sizeof(char));
+		write_offset = 0;
+		write_word(h, 1);
+		if(largeint) write_word(h, 0);
+		write_register(h, o->size);
+		write_register(h, o->alignment);
+		require(header == pwrite(fd, h->contents, header, start), "Unable to write a compressed debug section\n");
+		move_file_bytes(fd, scratch, compressed, start + header);
+
+		o->size = header + compressed;
+		o->alignment = alignment;
+		o->flags = o->flags | SHF_COMPRESSED;
+		free(h->contents);
+		free(h);
+	}
+
+	o->offset = start;
+	return start + o->size;
+}
+
+void compress_debug_sections(struct segment* out, FILE* destination)
+{
+	/* Debug sections are the last thing in the file, so they only ever move down */
+	fflush(destination);
+	int fd = fileno(destination);
+	struct output_section* o = debug_sections;
+	if((NULL == o) || (NULL == o->pieces)) return;
+
+	/* Everything after the last section is free to compress into */
+	SCM scratch = 0;
+	for(o = debug_sections; (NULL != o) && (NULL != o->pieces); o = o->next) scratch = o->offset + o->size;
+
+	SCM next = debug_sections->offset;
+	for(o = debug_sections; (NULL != o) && (NULL != o->pieces); o = o->next)
+	{
+		/* Inputs that were already compressed are passed through as they are */
+		if(0 != (o->flags & SHF_COMPRESSED))
+		{
+			if(next != o->offset)
+			{
+				next = align_up(next, o->alignment);
+				move_file_bytes(fd, o->offset, o->size, next);
+				o->offset = next;
+			}
+			next = o->offset + o->size;
+		}
+		else next = compress_debug_section(o, fd, next, scratch);
+
+		write_offset = section_header_offset + (o->index * section_header_size());
+		write_section_header(out, o);
+	}
+
+	require(0 == ftruncate(fd, next), "Unable to trim the output file\n");
+}
@@ -17,20 +17,109 @@
 
 #include "Meteoroid.h"
 
-void print_byte(int c, FILE* f);
-void print_address(SCM address, FILE* f);
-int in_set(int c, char* s);
+// CONSTANT DUMP_BUFFER_SIZE 1048576
+#define DUMP_BUFFER_SIZE 1048576
 
-void sane_print(int c, FILE* f)
+/* Output is formatted into one big buffer and written out in large blocks */
+char* dump_buffer;
+SCM dump_used;
+/* Two hex digits per byte value */
+char* hex_table;
+/* Printable form of each byte value, 4 bytes per entry with a length */
+char* sane_table;
+int* sane_length;
+
+void dump_flush()
 {
-	if(in_set(c, " !\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~")) fputc(c, f);
-	else
+	if(0 != dump_used) fwrite(dump_buffer, sizeof(char), dump_used, stdout);
+	dump_used = 0;
+}
+
+void dump_reserve(SCM size)
+{
+	if(DUMP_BUFFER_SIZE < dump_used + size) dump_flush();
+}
+
+void dump_string(char* s)
+{
+	while(0 != s[0])
+	{
+		dump_reserve(1);
+		dump_buffer[dump_used] = s[0];
+		dump_used = dump_used + 1;
+		s = s + 1;
+	}
+}
+
+void dump_setup()
+{
+	if(NULL != dump_buffer) return;
+
+	dump_buffer = calloc(DUMP_BUFFER_SIZE, sizeof(char));
+	dump_used = 0;
+	hex_table = calloc(512, sizeof(char));
+	sane_table = calloc(1024, sizeof(char));
+	sane_length = calloc(256, sizeof(int));
+
+	char* digits = "0123456789ABCDEF";
+	int c;
+	for(c = 0; c < 256; c = c + 1)
 	{
-		file_print("\\x", f);
-		print_byte(c, f);
+		hex_table[2 * c] = digits[(c & 0xF0) >> 4];
+		hex_table[2 * c + 1] = digits[c & 0xF];
+
+		/* Printable ASCII is itself, everything else is \xNN */
+		if((' ' <= c) && ('~' >= c))
+		{
+			sane_table[4 * c] = c;
+			sane_length[c] = 1;
+		}
+		else
+		{
+			sane_table[4 * c] = '\\';
+			sane_table[4 * c + 1] = 'x';
+			sane_table[4 * c + 2] = hex_table[2 * c];
+			sane_table[4 * c + 3] = hex_table[2 * c + 1];
+			sane_length[c] = 4;
+		}
 	}
 }
 
+void dump_hex(int c)
+{
+	c = c & 0xFF;
+	dump_buffer[dump_used] = hex_table[2 * c];
+	dump_buffer[dump_used + 1] = hex_table[2 * c + 1];
+	dump_used = dump_used + 2;
+}
+
+void dump_sane(int c)
+{
+	c = c & 0xFF;
+	int i;
+	for(i = 0; i < sane_length[c]; i = i + 1)
+	{
+		dump_buffer[dump_used + i] = sane_table[4 * c + i];
+	}
+	dump_used = dump_used + sane_length[c];
+}
+
+void dump_address(SCM address)
+{
+	if(largeint)
+	{
+		dump_hex(address >> 56);
+		dump_hex(address >> 48);
+		dump_hex(address >> 40);
+		dump_hex(address >> 32);
+	}
+
+	dump_hex(address >> 24);
+	dump_hex(address >> 16);
+	dump_hex(address >> 8);
+	dump_hex(address);
+}
+
 void print_segment(struct elf_section_header* s, char* name)
 {
 	if(NULL != s)
@@ -38,50 +127,77 @@ void print_segment(struct elf_section_header* s, char* name)
 		require(match(s->sh_name, name), "Tried to print the wrong segment\nAborting\n");
 
 		struct segment* contents = s->contents;
-		file_print("Segment type: ", stdout);
-		file_print(name, stdout);
-		file_print("\n", stdout);
+		dump_string("Segment type: ");
+		dump_string(name);
+		dump_string("\n");
 
-		int i = 0;
-		int address = contents->starting_address;
-		int size = s->sh_size;
+		SCM i = 0;
+		SCM j;
+		SCM address = contents->starting_address;
+		SCM size = s->sh_size;
+		char* bytes = contents->contents;
+		int c;
 		while(i < size)
 		{
-			print_address(address, stdout);
-			file_print(":\t", stdout);
-			print_byte(contents->contents[i], stdout);
-			print_byte(contents->contents[i+1], stdout);
-			print_byte(contents->contents[i+2], stdout);
-			print_byte(contents->contents[i+3], stdout);
-
-			file_print(" :: ", stdout);
-			sane_print(contents->contents[i], stdout);
-			sane_print(contents->contents[i+1], stdout);
-			sane_print(contents->contents[i+2], stdout);
-			sane_print(contents->contents[i+3], stdout);
+			/* Worst case line: 16 address digits, 8 hex digits, 16 escaped bytes and punctuation */
+			dump_reserve(64);
+			dump_address(address);
+			dump_buffer[dump_used] = ':';
+			dump_buffer[dump_used + 1] = '\t';
+			dump_used = dump_used + 2;
+			for(j = i; j < i + 4; j = j + 1)
+			{
+				c = 0;
+				if(j < contents->size) c = bytes[j];
+				dump_hex(c);
+			}
+
+			dump_buffer[dump_used] = ' ';
+			dump_buffer[dump_used + 1] = ':';
+			dump_buffer[dump_used + 2] = ':';
+			dump_buffer[dump_used + 3] = ' ';
+			dump_used = dump_used + 4;
+			for(j = i; j < i + 4; j = j + 1)
+			{
+				c = 0;
+				if(j < contents->size) c = bytes[j];
+				dump_sane(c);
+			}
+			dump_buffer[dump_used] = '\n';
+			dump_used = dump_used + 1;
+
 			i = i + 4;
 			address = address + 4;
-			file_print("\n", stdout);
 		}
 	}
 	else
 	{
+		dump_flush();
 		file_print("EMPTY SEGMENT!\n", stdout);
 		exit(EXIT_FAILURE);
 	}
 }
 
+void print_sections(struct elf_section_header* s)
+{
+	/* Lowest index first; only loaded sections with contents in the file */
+	if(NULL == s) return;
+	print_sections(s->next);
+	if((NULL != s->output) && (0 != (s->sh_flags & 2)) && (8 != s->sh_type)) print_segment(s, s->sh_name);
+}
+
 void print_file(struct elf_object_file* f)
 {
+	dump_setup();
 	while(NULL != f)
 	{
-		file_print("FILE NAME: ", stdout);
-		file_print(f->name, stdout);
-		file_print("\n", stdout);
+		dump_string("FILE NAME: ");
+		dump_string(f->name);
+		dump_string("\n");
 
-		if(NULL != f->text) print_segment(f->text, ".text");
-		if(NULL != f->data) print_segment(f->data, ".data");
+		print_sections(f->sections);
 
 		f = f->next;
 	}
+	dump_flush();
 }
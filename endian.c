@@ -16,10 +16,12 @@
  */
 
 #include "Meteoroid.h"
+#include <sys/mman.h>
+#include <unistd.h>
 
 int get_char(struct segment* f)
 {
-	if(read_offset > f->size) return -1;
+	if(read_offset >= f->size) return -1;
 
 	/* GCC seems to think returning more than a byte from a byte string is a good idea sometimes ??? */
 	int r = (f->contents[read_offset]) & 0xFF;
@@ -71,122 +73,54 @@ int read_half_big_endian(struct segment* f, char* failure)
 	return r;
 }
 
-int read_word_little_endian(struct segment* f, char* failure)
+SCM read_word_little_endian(struct segment* f, char* failure)
 {
-	int a = 0;
-	int b = 0;
-	int c = 0;
-	int d = 0;
-	int r = 0;
-
-	/* Read first byte */
-	int t = get_char(f);
-	require(EOF != t, failure);
-	d = t;
-
-	/* Read second byte */
-	t = get_char(f);
-	require(EOF != t, failure);
-	c = t;
-
-	/* Read third byte */
-	t = get_char(f);
-	require(EOF != t, failure);
-	b = t;
-
-	/* Read fourth byte */
-	t = get_char(f);
-	require(EOF != t, failure);
-	a = t;
-
-	/* Use multiplication to ensure platform correct behavior */
-	r = (a * 16777216) + (b * 65536) + (c * 256) + d;
-	return r;
-}
-
-int read_word_big_endian(struct segment* f, char* failure)
-{
-	int r = 0;
-	int c;
+	SCM r = 0;
+	SCM c;
 	int i;
 
-	/* Read 4 bytes */
-	for(i = 4; i > 0; i = i - 1)
+	/* Read 4 bytes, least significant first */
+	for(i = 0; i < 32; i = i + 8)
 	{
 		c = get_char(f);
 		require(EOF != c, failure);
-		r = (r * 256) + c;
+		r = r + (c << i);
 	}
 
 	return r;
 }
 
-int read_double_little_endian(struct segment* f, char* failure)
+SCM read_word_big_endian(struct segment* f, char* failure)
 {
-	int a = 0;
-	int b = 0;
-	int c = 0;
-	int d = 0;
-	int r = 0;
+	SCM r = 0;
+	int c;
 	int i;
 
-	/* Read first byte */
-	int t = get_char(f);
-	require(EOF != t, failure);
-	d = t;
-
-	/* Read second byte */
-	t = get_char(f);
-	require(EOF != t, failure);
-	c = t;
-
-	/* Read third byte */
-	t = get_char(f);
-	require(EOF != t, failure);
-	b = t;
-
-	/* Read fourth byte */
-	t = get_char(f);
-	require(EOF != t, failure);
-	a = t;
-
-	/* Use multiplication to ensure platform correct behavior */
-	r = (a * 16777216) + (b * 65536) + (c * 256) + d;
-
-	/* make sure it fits in 32bits */
+	/* Read 4 bytes */
 	for(i = 4; i > 0; i = i - 1)
 	{
 		c = get_char(f);
 		require(EOF != c, failure);
-		require(0 == c, "M3-Meteoroid currently only supports binaries under 2GB in size\n");
+		r = (r << 8) + c;
 	}
 
 	return r;
 }
 
-int read_double_big_endian(struct segment* f, char* failure)
+SCM read_double_little_endian(struct segment* f, char* failure)
 {
-	int r = 0;
-	int c;
-	int i;
-
-	/* make sure it fits in 32bits */
-	for(i = 4; i > 0; i = i - 1)
-	{
-		c = get_char(f);
-		require(EOF != c, failure);
-		require(0 == c, "M3-Meteoroid currently only supports binaries under 2GB in size\n");
-	}
-
-	/* Read 4 bytes */
-	for(i = 4; i > 0; i = i - 1)
-	{
-		c = get_char(f);
-		require(EOF != c, failure);
-		r = (r * 256) + c;
-	}
+	/* Low word comes first */
+	SCM low = read_word_little_endian(f, failure);
+	SCM high = read_word_little_endian(f, failure);
+	return (high << 32) + low;
+}
 
-	return r;
+SCM read_double_big_endian(struct segment* f, char* failure)
+{
+	/* High word comes first */
+	SCM high = read_word_big_endian(f, failure);
+	SCM low = read_word_big_endian(f, failure);
+	return (high << 32) + low;
 }
 
 int read_half(struct segment* f, char* failure)
@@ -195,13 +129,13 @@ int read_half(struct segment* f, char* failure)
 	else return read_half_little_endian(f, failure);
 }
 
-int read_word(struct segment* f, char* failure)
+SCM read_word(struct segment* f, char* failure)
 {
 	if(BigEndian) return read_word_big_endian(f, failure);
 	else return read_word_little_endian(f, failure);
 }
 
-int read_double(struct segment* f, char* failure)
+SCM read_double(struct segment* f, char* failure)
 {
 	if(BigEndian) return read_double_big_endian(f, failure);
 	else return read_double_little_endian(f, failure);
@@ -213,7 +147,7 @@ SCM read_register(struct segment* f, char* failure)
 	else return read_word(f, failure);
 }
 
-char* read_string(struct segment* f, int base, int offset, char* error)
+char* read_string(struct segment* f, SCM base, SCM offset, char* error)
 {
 	/* Deal with NULL case */
 	if(0 == offset) return "";
@@ -221,13 +155,23 @@ char* read_string(struct segment* f, int base, int offset, char* error)
 	/* Protect pointer to file */
 	SCM p = read_offset;
 
-	char* r = calloc(MAX_STRING, sizeof(char));
+	/* Find the end first so every name only takes the space it needs */
 	read_offset = base + offset;
 	int c = get_char(f);
 	int i = 0;
 	while(0 != c)
 	{
 		require(EOF != c, error);
+		i = i + 1;
+		c = get_char(f);
+	}
+
+	char* r = calloc(i + 1, sizeof(char));
+	read_offset = base + offset;
+	i = 0;
+	c = get_char(f);
+	while(0 != c)
+	{
 		r[i] = c;
 		i = i + 1;
 		c = get_char(f);
@@ -254,7 +198,7 @@ void write_half_big_endian(struct segment* f, int o)
 	put_char(low, f);
 }
 
-void write_word_little_endian(struct segment* f, int o)
+void write_word_little_endian(struct segment* f, SCM o)
 {
 	int high = 0xFFFF & (o >> 16);
 	int low = o & 0xFFFF;
@@ -262,7 +206,7 @@ void write_word_little_endian(struct segment* f, int o)
 	write_half_little_endian(f, high);
 }
 
-void write_word_big_endian(struct segment* f, int o)
+void write_word_big_endian(struct segment* f, SCM o)
 {
 	int high = 0xFFFF & (o >> 16);
 	int low = o & 0xFFFF;
@@ -270,18 +214,16 @@ void write_word_big_endian(struct segment* f, int o)
 	write_half_big_endian(f, low);
 }
 
-void write_double_little_endian(struct segment* f, int o)
+void write_double_little_endian(struct segment* f, SCM o)
 {
-	/* currently only support values that fit in 32 bits */
-	write_half_little_endian(f, o);
-	write_half_little_endian(f, 0);
+	write_word_little_endian(f, o);
+	write_word_little_endian(f, o >> 32);
 }
 
-void write_double_big_endian(struct segment* f, int o)
+void write_double_big_endian(struct segment* f, SCM o)
 {
-	/* currently only support values that fit in 32 bits */
-	write_half_big_endian(f, 0);
-	write_half_big_endian(f, o);
+	write_word_big_endian(f, o >> 32);
+	write_word_big_endian(f, o);
 }
 
 void write_half(struct segment* f, int o)
@@ -290,19 +232,19 @@ void write_half(struct segment* f, int o)
 	else write_half_little_endian(f, o);
 }
 
-void write_word(struct segment* f, int o)
+void write_word(struct segment* f, SCM o)
 {
 	if(BigEndian) write_word_big_endian(f, o);
 	else write_word_little_endian(f, o);
 }
 
-void write_double(struct segment* f, int o)
+void write_double(struct segment* f, SCM o)
 {
 	if(BigEndian) write_double_big_endian(f, o);
 	else write_double_little_endian(f, o);
 }
 
-void write_register(struct segment* f, int o)
+void write_register(struct segment* f, SCM o)
 {
 	if(largeint) write_double(f, o);
 	else write_word(f, o);
@@ -319,11 +261,10 @@ void print_address(SCM address, FILE* f)
 {
 	if(largeint)
 	{
-		require( 0 == address >> 32, "M3-Meteoroid currently only supports printing addresses for binaries under 2GB in size\n");
-		print_byte(0, f);
-		print_byte(0, f);
-		print_byte(0, f);
-		print_byte(0, f);
+		print_byte((address >> 56) & 0xFF, f);
+		print_byte((address >> 48) & 0xFF, f);
+		print_byte((address >> 40) & 0xFF, f);
+		print_byte((address >> 32) & 0xFF, f);
 	}
 
 	print_byte((address & 0xFF000000) >> 24, f);
@@ -348,49 +289,56 @@ struct segment* get_file(FILE* f, char* name)
 	struct segment* b = calloc(1, sizeof(struct segment));
 	b->size = ftell(f);
 	b->name = name;
-	fseek(f, 0, SEEK_SET);
-	b->contents = calloc(b->size + 4, sizeof(char));
+	require(0 < b->size, "Input file is empty\n");
 
-	int i = 0;
-	int C;
-	while(i < b->size)
-	{
-		C = fgetc(f);
-		require(EOF != C, "File changed size before done reading file\n");
-		b->contents[i] = C;
-		i = i + 1;
-	}
+	/* Map the file instead of reading it, so only the pages actually used
+	 * are ever brought in and sections can point straight into it */
+	b->contents = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+	require(MAP_FAILED != b->contents, "Unable to map input file\n");
+	fclose(f);
 
 	return b;
 }
 
-struct segment* output_buffer_generate()
+SCM build_id_note_size();
+
+int output_program_header_count()
 {
-	struct segment* r = calloc(1, sizeof(struct segment));
-	if(largeint)
-	{
-		/* ELF header required */
-		r->size = 64;
-		/* .text segment entry */
-		r->size = r->size + 52;
-		/* .data segment entry */
-		r->size = r->size + 52;
-	}
-	else
-	{
-		/* ELF header required */
-		r->size = 52;
-		/* .text segment entry */
-		r->size = r->size + 32;
-		/* .data segment entry */
-		r->size = r->size + 32;
-	}
+	/* A relocatable output has no segments */
+	if(Relocatable) return 0;
+
+	/* .text and .data, plus the build-id note */
+	if(BuildID) return 3;
+	return 2;
+}
 
-	/* .text segment */
-	r->size = r->size + text_size;
-	/* .data segment */
-	r->size = r->size + data_size;
+SCM output_program_headers_end()
+{
+	if(largeint) return 64 + (output_program_header_count() * 56);
+	return 52 + (output_program_header_count() * 32);
+}
 
+SCM output_header_size()
+{
+	/* ELF header followed by the segment entries and any notes */
+	return output_program_headers_end() + build_id_note_size();
+}
+
+struct segment* output_buffer_generate(SCM size)
+{
+	struct segment* r = calloc(1, sizeof(struct segment));
+	r->size = size;
 	r->contents = calloc(r->size, sizeof(char));
 	return r;
 }
+
+struct segment* output_file_map(FILE* f, SCM size)
+{
+	/* The image is built in place in the output file instead of in a buffer that is written out */
+	require(0 == ftruncate(fileno(f), size), "Unable to set the size of the output file\n");
+	struct segment* r = calloc(1, sizeof(struct segment));
+	r->size = size;
+	r->contents = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(f), 0);
+	require(MAP_FAILED != r->contents, "Unable to map the output file\n");
+	return r;
+}
@@ -1,28 +0,0 @@
-/* Copyright (C) 2016 Jeremiah Orians
- * This file is part of M3-Meteoroid.
- *
- * M3-Meteoroid is free software: you can redistribute it and/or modify
- * it under the terms of the GNU General Public License as published by
- * the Free Software Foundation, either version 3 of the License, or
- * (at your option) any later version.
- *
- * M3-Meteoroid is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
- * GNU General Public License for more details.
- *
- * You should have received a copy of the GNU General Public License
- * along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
- */
-#include<stdio.h>
-// void fputc(char s, FILE* f);
-
-void raw_write(char* s, FILE* f, int count)
-{
-	while(0 != count)
-	{
-		fputc(s[0], f);
-		s = s + 1;
-		count = count - 1;
-	}
-}
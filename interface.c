@@ -16,20 +16,77 @@
  */
 
 #include "Meteoroid.h"
+#include <sys/stat.h>
 
 struct buffer* get_file(FILE* f, char* name);
 void architecture_load(struct buffer* in);
 char* binary_name();
 int page_size();
-SCM realign_text_segments(struct elf_object_file* h);
-void realign_data_segments(int page_size);
-struct symbol* generate_symbol_table(struct elf_object_file* h);
-struct relocation* collection_relocations(struct elf_object_file* f);
+struct elf_object_file* reverse_nodes(struct elf_object_file* head);
+void default_section_rules();
+void read_section_rules(char* name);
+struct task* build_link_tasks(struct elf_object_file* files);
+void run_tasks(struct task* head);
+struct segment* output_generate(int page_size, FILE* destination);
+SCM output_program_headers_end();
+void generate_build_id(struct segment* f, SCM offset, int fd);
+void copy_debug_sections(FILE* destination);
+void fill_global_offset_table();
 void apply_relocations();
+void stream_objects(struct elf_object_file* f, struct segment* out, FILE* destination);
+void compress_debug_sections(struct segment* out, FILE* destination);
+SCM* perf_begin();
+void perf_end(SCM* start, char* phase, char* name);
 void print_file(struct elf_object_file* f);
 SCM Get_base_address();
 int numerate_string(char *a);
 
+char* option_value(char* argument, char* prefix)
+{
+	/* Returns what follows prefix for --option=value style arguments */
+	int i = 0;
+	while(0 != prefix[i])
+	{
+		if(argument[i] != prefix[i]) return NULL;
+		i = i + 1;
+	}
+	return argument + i;
+}
+
+SCM numerate_size(char* a)
+{
+	/* Allow a K, M or G suffix, such as 2M */
+	SCM scale = 1;
+	int i = 0;
+	while(0 != a[i]) i = i + 1;
+	if(0 == i) return 0;
+
+	char* digits = calloc(i + 1, sizeof(char));
+	int j;
+	for(j = 0; j < i; j = j + 1) digits[j] = a[j];
+	if(('K' == a[i - 1]) || ('k' == a[i - 1])) scale = 1024;
+	else if(('M' == a[i - 1]) || ('m' == a[i - 1])) scale = 1024 * 1024;
+	else if(('G' == a[i - 1]) || ('g' == a[i - 1])) scale = 1024 * 1024 * 1024;
+	if(1 != scale) digits[i - 1] = 0;
+
+	return numerate_string(digits) * scale;
+}
+
+void set_function_align(char* value)
+{
+	FunctionAlign = numerate_size(value);
+	require(0 < FunctionAlign, "--function-align needs a size such as 16 or 64\n");
+	require(0 == (FunctionAlign & (FunctionAlign - 1)), "--function-align must be a power of two\n");
+}
+
+void set_segment_align(char* value)
+{
+	SegmentAlign = numerate_size(value);
+	require(0 < SegmentAlign, "--segment-align needs a size such as 4096 or 2M\n");
+	require(0 == (SegmentAlign & (SegmentAlign - 1)), "--segment-align must be a power of two\n");
+	require(SegmentAlign >= page_size(), "--segment-align can not be smaller than the page size\n");
+}
+
 int main(int argc, char** argv)
 {
 	struct buffer* in;
@@ -37,14 +94,36 @@ int main(int argc, char** argv)
 	FILE* destination_file;
 	char* destination_name = "a.out";
 	BaseAddress = Get_base_address();
+	SegmentAlign = page_size();
+	FunctionAlign = 1;
 	VERBOSE = FALSE;
 	DEBUG = FALSE;
+	BuildID = FALSE;
+	StripAll = FALSE;
+	LowMemory = FALSE;
+	CompressDebug = FALSE;
+	EmitRelocs = FALSE;
+	Relocatable = FALSE;
+	PerfCounters = FALSE;
 	text_size = 0;
 	data_size = 0;
+	bss_size = 0;
 	int PrePRINT = FALSE;
 	int PRINT = FALSE;
+	OrderingFile = NULL;
+	CallGraph = FALSE;
+	SampleFile = NULL;
+	default_section_rules();
+	SCM* counters;
 
-	int i = 1;
+	/* Inputs are read as they are named, so this has to be known before any of them */
+	int i;
+	for(i = 1; i < argc; i = i + 1)
+	{
+		if(match(argv[i], "--perf-counters")) PerfCounters = TRUE;
+	}
+
+	i = 1;
 	while(i <= argc)
 	{
 		if(NULL == argv[i])
@@ -78,6 +157,7 @@ int main(int argc, char** argv)
 			current_file = calloc(1, sizeof(struct elf_object_file));
 			current_file->next = hold;
 			current_file->name = name;
+			counters = perf_begin();
 			in = get_file(fopen(name, "r"), name);
 			if(NULL == in)
 			{
@@ -89,6 +169,7 @@ int main(int argc, char** argv)
 
 			architecture_load(in);
 			require(current_file->header->e_type == 1, "M3-Meteoroid only supports linking relocatable files\n");
+			perf_end(counters, "parse", name);
 			i = i + 2;
 		}
 		else if(match(argv[i], "-o") || match(argv[i], "--output"))
@@ -101,11 +182,105 @@ int main(int argc, char** argv)
 			BaseAddress = numerate_string(argv[i + 1]);
 			i = i + 2;
 		}
+		else if(match(argv[i], "--segment-align"))
+		{
+			set_segment_align(argv[i + 1]);
+			i = i + 2;
+		}
+		else if(NULL != option_value(argv[i], "--segment-align="))
+		{
+			set_segment_align(option_value(argv[i], "--segment-align="));
+			i = i + 1;
+		}
+		else if(match(argv[i], "--function-align"))
+		{
+			set_function_align(argv[i + 1]);
+			i = i + 2;
+		}
+		else if(NULL != option_value(argv[i], "--function-align="))
+		{
+			set_function_align(option_value(argv[i], "--function-align="));
+			i = i + 1;
+		}
+		else if(match(argv[i], "--build-id"))
+		{
+			BuildID = TRUE;
+			i = i + 1;
+		}
+		else if(match(argv[i], "--compress-debug-sections") || match(argv[i], "--compress-debug-sections=zlib"))
+		{
+			CompressDebug = TRUE;
+			i = i + 1;
+		}
+		else if(match(argv[i], "--compress-debug-sections=none"))
+		{
+			CompressDebug = FALSE;
+			i = i + 1;
+		}
+		else if(match(argv[i], "--perf-counters"))
+		{
+			/* Already picked up before the inputs were read */
+			i = i + 1;
+		}
+		else if(match(argv[i], "-r") || match(argv[i], "--relocatable"))
+		{
+			Relocatable = TRUE;
+			i = i + 1;
+		}
+		else if(match(argv[i], "-q") || match(argv[i], "--emit-relocs"))
+		{
+			EmitRelocs = TRUE;
+			i = i + 1;
+		}
+		else if(match(argv[i], "--low-memory"))
+		{
+			LowMemory = TRUE;
+			i = i + 1;
+		}
+		else if(match(argv[i], "-s") || match(argv[i], "--strip-all"))
+		{
+			StripAll = TRUE;
+			i = i + 1;
+		}
+		else if(match(argv[i], "--symbol-ordering-file"))
+		{
+			OrderingFile = argv[i + 1];
+			i = i + 2;
+		}
+		else if(match(argv[i], "--call-graph-order"))
+		{
+			CallGraph = TRUE;
+			i = i + 1;
+		}
+		else if(match(argv[i], "--sample-counts"))
+		{
+			SampleFile = argv[i + 1];
+			i = i + 2;
+		}
+		else if(match(argv[i], "--section-map"))
+		{
+			read_section_rules(argv[i + 1]);
+			i = i + 2;
+		}
 		else if(match(argv[i], "-h") || match(argv[i], "--help"))
 		{
 			file_print("--file $input_file to set a file as input\n", stdout);
 			file_print("--output $output_file to set the output file, otherwise output is to a.out\n", stdout);
-			file_print("--debug for including sections\n", stdout);
+			file_print("--base-address $address to set where .text is loaded\n", stdout);
+			file_print("--segment-align $size to align and pad .text, such as 2M for huge pages\n", stdout);
+			file_print("--function-align $size to start every code section on such a boundary, such as 64\n", stdout);
+			file_print("--symbol-ordering-file $file to place the listed functions first, in order\n", stdout);
+			file_print("--call-graph-order to cluster functions that call each other\n", stdout);
+			file_print("--sample-counts $file of symbol count lines to weight the call graph\n", stdout);
+			file_print("--section-map $file of pattern output lines to add to the input section mapping\n", stdout);
+			file_print("--build-id to add a .note.gnu.build-id hash of the output\n", stdout);
+			file_print("--strip-all to leave .symtab and .strtab out of the output\n", stdout);
+			file_print("--debug for including .debug_* sections\n", stdout);
+			file_print("--compress-debug-sections to write .debug_* sections zlib compressed, =none to turn it off\n", stdout);
+			file_print("--perf-counters to report the time, cycles, instructions, cache and branch misses and page faults of each link phase\n", stdout);
+			file_print("--relocatable or -r to combine the inputs into one relocatable object for a later link\n", stdout);
+			file_print("--emit-relocs to keep the applied relocations in the output for post-link optimizers\n", stdout);
+			file_print("--low-memory to map only one input at a time while writing the output\n", stdout);
 			file_print("--verbose for more in depth error messages\n", stdout);
 			file_print("--help for this message\n", stdout);
 			file_print("--version for file version\n", stdout);
@@ -124,10 +299,26 @@ int main(int argc, char** argv)
 		}
 	}
 
-	realign_text_segments(current_file);
-	realign_data_segments(page_size());
-	symbol_table = generate_symbol_table(current_file);
-	relocation_table = collection_relocations(current_file);
+	/* The second pass has nothing left to weigh calls with or print from */
+	require(!LowMemory || !CallGraph, "--low-memory can not be combined with --call-graph-order\n");
+	require(!LowMemory || (!PRINT && !PrePRINT), "--low-memory can not be combined with --print or --preprint\n");
+	require(!LowMemory || !EmitRelocs, "--low-memory can not be combined with --emit-relocs\n");
+
+	/* A relocatable output keeps every relocation, against the symbol or section it will be resolved with */
+	if(Relocatable)
+	{
+		require(!LowMemory, "--low-memory can not be combined with -r\n");
+		require(!DEBUG, "--debug can not be combined with -r\n");
+		require(!BuildID, "--build-id can not be combined with -r\n");
+		EmitRelocs = TRUE;
+	}
+
+	/* Emitted relocations name their symbols in .symtab */
+	require(!StripAll || !EmitRelocs, "--strip-all can not be combined with --emit-relocs or -r\n");
+
+	/* Put the files back into command line order, then map, lay out and resolve them */
+	current_file = reverse_nodes(current_file);
+	run_tasks(build_link_tasks(current_file));
 
 	if(PrePRINT)
 	{
@@ -135,15 +326,15 @@ int main(int argc, char** argv)
 		exit(EXIT_SUCCESS);
 	}
 
-	apply_relocations();
-
 	if(PRINT)
 	{
+		fill_global_offset_table();
+		apply_relocations();
 		print_file(current_file);
 		exit(EXIT_SUCCESS);
 	}
 
-	destination_file = fopen(destination_name, "w");
+	destination_file = fopen(destination_name, "w+");
 	if(NULL == destination_file)
 	{
 		file_print("Unable to open for writing file: ", stderr);
@@ -152,6 +343,37 @@ int main(int argc, char** argv)
 		exit(EXIT_FAILURE);
 	}
 
+	/* Sections are copied into the output first and relocated where they land */
+	counters = perf_begin();
+	struct segment* output = output_generate(page_size(), destination_file);
+	fill_global_offset_table();
+	perf_end(counters, "write output", NULL);
+	counters = perf_begin();
+	if(LowMemory) stream_objects(current_file, output, destination_file);
+	else
+	{
+		apply_relocations();
+		copy_debug_sections(destination_file);
+	}
+	perf_end(counters, "relocate", NULL);
+	if(CompressDebug)
+	{
+		counters = perf_begin();
+		compress_debug_sections(output, destination_file);
+		perf_end(counters, "compress debug sections", NULL);
+	}
+
+	/* Hash the finished image while it is still mapped */
+	if(BuildID)
+	{
+		counters = perf_begin();
+		generate_build_id(output, output_program_headers_end(), fileno(destination_file));
+		perf_end(counters, "build-id", NULL);
+	}
+	fclose(destination_file);
+
+	/* Make the result executable */
+	if(!Relocatable) chmod(destination_name, 0750);
 
 	return EXIT_SUCCESS;
 }
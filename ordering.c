@@ -0,0 +1,536 @@
+/* Copyright (C) 2020 Jeremiah Orians
+ * This file is part of M3-Meteoroid.
+ *
+ * M3-Meteoroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * M3-Meteoroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Meteoroid.h"
+
+// CONSTANT UNRANKED 0x7FFFFFFF
+#define UNRANKED 0x7FFFFFFF
+// CONSTANT MAX_CLUSTER_SIZE 1048576
+#define MAX_CLUSTER_SIZE 1048576
+// CONSTANT MAX_DENSITY_DEGRADATION 8
+#define MAX_DENSITY_DEGRADATION 8
+
+int numerate_string(char *a);
+int in_set(int c, char* s);
+SCM symbol_name_hash(char* name);
+struct elf_section_header* find_section_by_number(struct elf_object_file* f, int number);
+
+char* read_token(FILE* f)
+{
+	int c = fgetc(f);
+
+	/* Skip whitespace and # comments */
+	while(in_set(c, " \t\r\n#"))
+	{
+		if('#' == c)
+		{
+			while((EOF != c) && ('\n' != c)) c = fgetc(f);
+		}
+		else c = fgetc(f);
+	}
+	if(EOF == c) return NULL;
+
+	char* r = calloc(MAX_STRING, sizeof(char));
+	int i = 0;
+	while((EOF != c) && !in_set(c, " \t\r\n"))
+	{
+		require(MAX_STRING > i + 1, "Token in ordering file is too long\n");
+		r[i] = c;
+		i = i + 1;
+		c = fgetc(f);
+	}
+	return r;
+}
+
+FILE* open_ordering_file(char* name)
+{
+	FILE* f = fopen(name, "r");
+	if(NULL == f)
+	{
+		file_print("Unable to open for reading file: ", stderr);
+		file_print(name, stderr);
+		file_print("\n Aborting to avoid problems\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	return f;
+}
+
+struct name_index* new_name_index(SCM count)
+{
+	/* A power of two with room for count names */
+	struct name_index* r = calloc(1, sizeof(struct name_index));
+	r->size = 64;
+	while(r->size < count) r->size = r->size * 2;
+	r->buckets = calloc(r->size, sizeof(struct name_entry*));
+	return r;
+}
+
+struct name_entry* find_name(struct name_index* index, char* name)
+{
+	if(NULL == index) return NULL;
+	struct name_entry* e = index->buckets[symbol_name_hash(name) & (index->size - 1)];
+	while(NULL != e)
+	{
+		if(match(name, e->name)) return e;
+		e = e->next;
+	}
+	return NULL;
+}
+
+struct name_entry* add_name(struct name_index* index, char* name)
+{
+	/* Entries go on the end of their chain, so the first one added is found first */
+	struct name_entry* r = calloc(1, sizeof(struct name_entry));
+	r->name = name;
+	struct name_entry** slot = index->buckets + (symbol_name_hash(name) & (index->size - 1));
+	while(NULL != slot[0]) slot = &(slot[0]->next);
+	slot[0] = r;
+	return r;
+}
+
+struct name_index* read_sample_counts(char* name)
+{
+	/* Lines of: symbol count, a later line for the same symbol replaces an earlier one */
+	struct name_index* r = new_name_index(1024);
+	struct name_entry* e;
+	FILE* f = open_ordering_file(name);
+	char* symbol = read_token(f);
+	char* count;
+	while(NULL != symbol)
+	{
+		count = read_token(f);
+		require(NULL != count, "Sample count file has a symbol without a count\n");
+		e = find_name(r, symbol);
+		if(NULL == e) e = add_name(r, symbol);
+		e->count = numerate_string(count);
+		symbol = read_token(f);
+	}
+	fclose(f);
+	return r;
+}
+
+SCM find_sample_count(char* name, struct name_index* samples)
+{
+	struct name_entry* e = find_name(samples, name);
+	if(NULL == e) return 0;
+	return e->count;
+}
+
+struct placement* collect_placements(struct output_section* text)
+{
+	/* One placement per input section, in the order they were mapped */
+	struct placement* r = NULL;
+	struct placement* tail = NULL;
+	struct placement* hold;
+	struct elf_section_header* s;
+	SCM position = 0;
+	if(NULL == text) return NULL;
+
+	for(s = text->pieces; NULL != s; s = s->next_piece)
+	{
+		hold = calloc(1, sizeof(struct placement));
+		hold->file = s->file;
+		hold->section = s;
+		hold->size = s->sh_size;
+		hold->rank = UNRANKED;
+		hold->position = position;
+		hold->leader = hold;
+		hold->last = hold;
+		s->placement = hold;
+		if(NULL == tail) r = hold;
+		else tail->next = hold;
+		tail = hold;
+		position = position + 1;
+	}
+	return r;
+}
+
+struct placement* symbol_placement(struct elf_object_file* f, struct elf_symbol* i)
+{
+	/* Only symbols in a section that is being ordered have one */
+	struct elf_section_header* s = find_section_by_number(f, i->st_shndx);
+	if(NULL == s) return NULL;
+	return s->placement;
+}
+
+struct name_index* index_placements(struct elf_object_file* files, struct placement* placements)
+{
+	/* Every named symbol in .text, the first definition of a name wins */
+	SCM count = 0;
+	struct placement* p;
+	for(p = placements; NULL != p; p = p->next) count = count + 1;
+	struct name_index* r = new_name_index(2 * count);
+
+	struct elf_object_file* f;
+	struct elf_symbol* i;
+	struct name_entry* e;
+	for(f = files; NULL != f; f = f->next)
+	{
+		for(i = f->symbols; NULL != i; i = i->next)
+		{
+			p = symbol_placement(f, i);
+			if((NULL != p) && !match("", i->st_name))
+			{
+				e = find_name(r, i->st_name);
+				if(NULL == e)
+				{
+					e = add_name(r, i->st_name);
+					e->placement = p;
+				}
+				else if(!e->global && (0 != (i->st_info >> 4)))
+				{
+					/* A global definition beats a local of the same name */
+					e->placement = p;
+				}
+				if(0 != (i->st_info >> 4)) e->global = TRUE;
+			}
+		}
+	}
+	return r;
+}
+
+SCM apply_symbol_ordering_file(struct name_index* names, char* name)
+{
+	/* Each section takes the rank of the first listed symbol it defines */
+	FILE* f = open_ordering_file(name);
+	SCM rank = 0;
+	struct name_entry* e;
+	char* symbol = read_token(f);
+	while(NULL != symbol)
+	{
+		e = find_name(names, symbol);
+		if((NULL != e) && (UNRANKED == e->placement->rank)) e->placement->rank = rank;
+		else if((NULL == e) && VERBOSE)
+		{
+			file_print("WARNING: symbol in ordering file is not defined in .text: ", stderr);
+			file_print(symbol, stderr);
+			file_print("\n", stderr);
+		}
+		rank = rank + 1;
+		symbol = read_token(f);
+	}
+	fclose(f);
+	return rank;
+}
+
+struct call_edge* add_call_edge(struct call_edge* edges, struct placement* caller, struct placement* callee, SCM weight)
+{
+	/* Each caller only calls a few sections, so only its own edges are searched */
+	struct call_edge* e;
+	for(e = caller->calls; NULL != e; e = e->next_from_caller)
+	{
+		if(callee == e->callee)
+		{
+			e->weight = e->weight + weight;
+			return edges;
+		}
+	}
+
+	e = calloc(1, sizeof(struct call_edge));
+	e->caller = caller;
+	e->callee = callee;
+	e->weight = weight;
+	e->next_from_caller = caller->calls;
+	caller->calls = e;
+	e->next = edges;
+	return e;
+}
+
+struct call_edge* add_call_edges(struct call_edge* edges, struct placement* caller, struct elf_symbol* symbol, struct name_index* names, struct name_index* samples)
+{
+	/* Definitions in the same object are found by section, everything else by name */
+	struct placement* callee = symbol_placement(caller->file, symbol);
+	struct name_entry* e;
+	if((0 == symbol->st_shndx) && !match("", symbol->st_name))
+	{
+		e = find_name(names, symbol->st_name);
+		if((NULL != e) && e->global) callee = e->placement;
+	}
+
+	/* Only references that leave the section are interesting */
+	if((NULL == callee) || (caller == callee)) return edges;
+
+	/* With a profile, a call from code that never ran says nothing about how often it is
+	 * taken; pulling a hot callee behind such a caller only moves it away from the front */
+	if((NULL != samples) && (0 == caller->samples)) return edges;
+
+	return add_call_edge(edges, caller, callee, 1 + find_sample_count(symbol->st_name, samples));
+}
+
+struct call_edge* build_call_graph(struct placement* placements, struct name_index* names, struct name_index* samples)
+{
+	struct call_edge* edges = NULL;
+	struct placement* p;
+	struct elf_relocation* r;
+	struct elf_adjusted_relocation* a;
+	for(p = placements; NULL != p; p = p->next)
+	{
+		for(r = p->section->r; NULL != r; r = r->next) edges = add_call_edges(edges, p, r->symbol, names, samples);
+		for(a = p->section->ar; NULL != a; a = a->next) edges = add_call_edges(edges, p, a->symbol, names, samples);
+	}
+	return edges;
+}
+
+struct call_edge* sort_call_edges(struct call_edge* head)
+{
+	if((NULL == head) || (NULL == head->next)) return head;
+
+	/* Split the list in half */
+	struct call_edge* slow = head;
+	struct call_edge* fast = head->next;
+	while((NULL != fast) && (NULL != fast->next))
+	{
+		slow = slow->next;
+		fast = fast->next->next;
+	}
+	struct call_edge* back = slow->next;
+	slow->next = NULL;
+
+	struct call_edge* a = sort_call_edges(head);
+	struct call_edge* b = sort_call_edges(back);
+
+	/* Heaviest edges first */
+	struct call_edge* r = NULL;
+	struct call_edge* tail = NULL;
+	struct call_edge* hold;
+	while((NULL != a) || (NULL != b))
+	{
+		if((NULL == b) || ((NULL != a) && (a->weight >= b->weight)))
+		{
+			hold = a;
+			a = a->next;
+		}
+		else
+		{
+			hold = b;
+			b = b->next;
+		}
+
+		if(NULL == tail) r = hold;
+		else tail->next = hold;
+		tail = hold;
+	}
+	tail->next = NULL;
+
+	return r;
+}
+
+struct placement* find_leader(struct placement* p)
+{
+	/* Leaders are only fixed up lazily, halve the path on the way */
+	while(p != p->leader)
+	{
+		p->leader = p->leader->leader;
+		p = p->leader;
+	}
+	return p;
+}
+
+void merge_clusters(struct placement* caller, struct placement* callee)
+{
+	/* The callee's cluster is placed right after the caller's */
+	struct placement* a = find_leader(caller);
+	struct placement* b = find_leader(callee);
+	if(a == b) return;
+	if(MAX_CLUSTER_SIZE < a->size + b->size) return;
+
+	/* As in C3, a merge may not leave the denser side with less than an eighth of its
+	 * samples per byte. Both sides are checked, as an edge's weight does not say how
+	 * often its caller ran */
+	struct placement* hot = a;
+	if(b->samples * a->size > a->samples * b->size) hot = b;
+	if((a->samples + b->samples) * hot->size * MAX_DENSITY_DEGRADATION < hot->samples * (a->size + b->size)) return;
+
+	a->last->members = b;
+	a->last = b->last;
+	a->size = a->size + b->size;
+	a->samples = a->samples + b->samples;
+	b->leader = a;
+}
+
+int cluster_before(struct placement* a, struct placement* b)
+{
+	/* Hottest bytes first, ties keep the command line order */
+	SCM left = a->samples * b->size;
+	SCM right = b->samples * a->size;
+	if(left != right) return left > right;
+	return a->position <= b->position;
+}
+
+struct placement* sort_clusters(struct placement* head)
+{
+	/* Clusters are chained through last so the placement list is left alone */
+	if((NULL == head) || (NULL == head->last)) return head;
+
+	/* Split the list in half */
+	struct placement* slow = head;
+	struct placement* fast = head->last;
+	while((NULL != fast) && (NULL != fast->last))
+	{
+		slow = slow->last;
+		fast = fast->last->last;
+	}
+	struct placement* back = slow->last;
+	slow->last = NULL;
+
+	struct placement* a = sort_clusters(head);
+	struct placement* b = sort_clusters(back);
+
+	/* Merge the sorted halves back together */
+	struct placement* r = NULL;
+	struct placement* tail = NULL;
+	struct placement* hold;
+	while((NULL != a) || (NULL != b))
+	{
+		if((NULL == b) || ((NULL != a) && cluster_before(a, b)))
+		{
+			hold = a;
+			a = a->last;
+		}
+		else
+		{
+			hold = b;
+			b = b->last;
+		}
+
+		if(NULL == tail) r = hold;
+		else tail->last = hold;
+		tail = hold;
+	}
+	tail->last = NULL;
+
+	return r;
+}
+
+void cluster_call_graph(struct elf_object_file* files, struct placement* placements, struct name_index* names, struct name_index* samples, SCM first_rank)
+{
+	struct placement* p;
+	struct elf_object_file* f;
+	struct elf_symbol* i;
+
+	/* A section is as hot as the functions it holds */
+	for(f = files; NULL != f; f = f->next)
+	{
+		for(i = f->symbols; NULL != i; i = i->next)
+		{
+			p = symbol_placement(f, i);
+			if(NULL != p) p->samples = p->samples + find_sample_count(i->st_name, samples);
+		}
+	}
+
+	struct call_edge* e;
+	for(e = sort_call_edges(build_call_graph(placements, names, samples)); NULL != e; e = e->next)
+	{
+		merge_clusters(e->caller, e->callee);
+	}
+
+	/* Gather the leaders, reusing last as the link between clusters */
+	struct placement* leaders = NULL;
+	struct placement* tail = NULL;
+	for(p = placements; NULL != p; p = p->next)
+	{
+		if(p == p->leader)
+		{
+			if(NULL == tail) leaders = p;
+			else tail->last = p;
+			tail = p;
+		}
+	}
+	if(NULL != tail) tail->last = NULL;
+
+	/* Sections named by an ordering file keep their place */
+	SCM rank = first_rank;
+	struct placement* m;
+	for(p = sort_clusters(leaders); NULL != p; p = p->last)
+	{
+		for(m = p; NULL != m; m = m->members)
+		{
+			if(UNRANKED == m->rank)
+			{
+				m->rank = rank;
+				rank = rank + 1;
+			}
+		}
+	}
+}
+
+int placement_before(struct placement* a, struct placement* b)
+{
+	if(a->rank != b->rank) return a->rank < b->rank;
+	return a->position <= b->position;
+}
+
+struct placement* sort_placements(struct placement* head)
+{
+	if((NULL == head) || (NULL == head->next)) return head;
+
+	/* Split the list in half */
+	struct placement* slow = head;
+	struct placement* fast = head->next;
+	while((NULL != fast) && (NULL != fast->next))
+	{
+		slow = slow->next;
+		fast = fast->next->next;
+	}
+	struct placement* back = slow->next;
+	slow->next = NULL;
+
+	struct placement* a = sort_placements(head);
+	struct placement* b = sort_placements(back);
+
+	/* Merge the sorted halves back together */
+	struct placement* r = NULL;
+	struct placement* tail = NULL;
+	struct placement* hold;
+	while((NULL != a) || (NULL != b))
+	{
+		if((NULL == b) || ((NULL != a) && placement_before(a, b)))
+		{
+			hold = a;
+			a = a->next;
+		}
+		else
+		{
+			hold = b;
+			b = b->next;
+		}
+
+		if(NULL == tail) r = hold;
+		else tail->next = hold;
+		tail = hold;
+	}
+	tail->next = NULL;
+
+	return r;
+}
+
+struct placement* order_text_sections(struct output_section* text, struct elf_object_file* files, char* ordering_file, int call_graph, char* sample_file)
+{
+	struct placement* r = collect_placements(text);
+	struct name_index* names = index_placements(files, r);
+	SCM rank = 0;
+	if(NULL != ordering_file) rank = apply_symbol_ordering_file(names, ordering_file);
+
+	if(call_graph)
+	{
+		struct name_index* samples = NULL;
+		if(NULL != sample_file) samples = read_sample_counts(sample_file);
+		cluster_call_graph(files, r, names, samples, rank);
+	}
+
+	return sort_placements(r);
+}
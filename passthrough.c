@@ -0,0 +1,191 @@
+/* Copyright (C) 2020 Jeremiah Orians
+ * This file is part of M3-Meteoroid.
+ *
+ * M3-Meteoroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * M3-Meteoroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Meteoroid.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+
+int has_prefix(char* s, char* prefix);
+SCM align_up(SCM address, SCM alignment);
+struct segment* view_segment(struct segment* f, SCM offset, SCM size, char* name);
+struct relocation* collect_implicit_relocations(struct relocation* r, struct elf_object_file* f, struct elf_relocation* a, struct elf_section_header* target);
+struct relocation* collect_explicit_relocations(struct relocation* r, struct elf_object_file* f, struct elf_adjusted_relocation* a, struct elf_section_header* target);
+void patch_relocations(struct relocation* r, struct segment* debug);
+int page_size();
+
+struct output_section* find_debug_output_section(char* name)
+{
+	struct output_section* i = debug_sections;
+	struct output_section* last = NULL;
+	while(NULL != i)
+	{
+		if(match(name, i->name)) return i;
+		last = i;
+		i = i->next;
+	}
+
+	/* New output sections are added in order of first appearance; SHT_PROGBITS */
+	struct output_section* r = calloc(1, sizeof(struct output_section));
+	r->name = name;
+	r->type = 1;
+	r->alignment = 1;
+	if(NULL == last) debug_sections = r;
+	else last->next = r;
+	return r;
+}
+
+void add_debug_piece(struct elf_section_header* s, struct segment* in)
+{
+	struct output_section* o = find_debug_output_section(s->sh_name);
+	s->output = o;
+	s->contents = view_segment(in, s->sh_offset, s->sh_size, s->sh_name);
+
+	/* SHF_COMPRESSED sections are copied as they are, which only works when nothing else shares the output */
+	if(0 != (s->sh_flags & 0x800))
+	{
+		require(NULL == o->pieces, "A compressed debug section can only be passed through when no other input has a section of that name\n");
+		o->flags = o->flags | 0x800;
+	}
+	else require(0 == (o->flags & 0x800), "A compressed debug section can only be passed through when no other input has a section of that name\n");
+
+	/* Pieces are concatenated in command line order */
+	if(o->alignment < s->sh_addralign) o->alignment = s->sh_addralign;
+	s->contents->starting_address = align_up(o->size, s->sh_addralign);
+	o->size = s->contents->starting_address + s->sh_size;
+
+	if(NULL == o->pieces) o->pieces = s;
+	else o->last_piece->next_piece = s;
+	o->last_piece = s;
+}
+
+void read_object_debug_sections(struct elf_object_file* f)
+{
+	/* Their relocations are read along with everything else's */
+	struct elf_section_header* s;
+	for(s = f->sections; NULL != s; s = s->next)
+	{
+		/* Skip SHT_NOBITS, there is nothing to copy */
+		if(has_prefix(s->sh_name, ".debug_") && (8 != s->sh_type) && !s->discarded) add_debug_piece(s, f->input);
+	}
+}
+
+struct relocation* collect_object_debug_relocations(struct relocation* r, struct elf_object_file* f)
+{
+	struct elf_section_header* s;
+	for(s = f->sections; NULL != s; s = s->next)
+	{
+		/* Debug sections are the only ones with an output but without SHF_ALLOC */
+		if((NULL != s->output) && (0 == (s->sh_flags & 2)))
+		{
+			r = collect_implicit_relocations(r, f, s->r, s);
+			r = collect_explicit_relocations(r, f, s->ar, s);
+		}
+	}
+	return r;
+}
+
+void copy_file_bytes(struct elf_section_header* p, int out, SCM destination)
+{
+	int in = open(p->file->name, O_RDONLY);
+	require(0 <= in, "Unable to reopen input file for copying debug sections\n");
+
+	/* Let the kernel move the bytes file to file */
+	loff_t in_offset = p->sh_offset;
+	loff_t out_offset = destination;
+	SCM left = p->sh_size;
+	SCM done;
+	while(0 < left)
+	{
+		done = copy_file_range(in, &in_offset, out, &out_offset, left, 0);
+		if(0 >= done) break;
+		left = left - done;
+	}
+
+	/* Older kernels and some filesystems can't, sendfile writes at the current position */
+	if(0 < left)
+	{
+		off_t from = in_offset;
+		lseek(out, out_offset, SEEK_SET);
+		while(0 < left)
+		{
+			done = sendfile(out, in, &from, left);
+			if(0 >= done) break;
+			left = left - done;
+			out_offset = out_offset + done;
+		}
+		in_offset = from;
+	}
+
+	/* Last resort, write straight from the input mapping */
+	if(0 < left)
+	{
+		done = pwrite(out, p->file->input->contents + in_offset, left, out_offset);
+		require(done == left, "Unable to copy debug section to output\n");
+	}
+
+	close(in);
+}
+
+struct segment* map_debug_sections(int fd)
+{
+	/* From the page holding the first debug section to the end of the last one, which is the end of the file */
+	struct output_section* o = debug_sections;
+	if((NULL == o) || (NULL == o->pieces)) return NULL;
+	SCM end = 0;
+	for(o = debug_sections; (NULL != o) && (NULL != o->pieces); o = o->next) end = o->offset + o->size;
+	require(0 == ftruncate(fd, end), "Unable to set the size of the output file\n");
+
+	struct segment* r = calloc(1, sizeof(struct segment));
+	r->name = "debug sections";
+	r->starting_address = debug_sections->offset & ~(page_size() - 1);
+	r->size = end - r->starting_address;
+	r->contents = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, r->starting_address);
+	require(MAP_FAILED != r->contents, "Unable to map the debug sections of the output file\n");
+	return r;
+}
+
+void unmap_debug_sections(struct segment* debug)
+{
+	if(NULL == debug) return;
+	munmap(debug->contents, debug->size);
+	free(debug);
+}
+
+void copy_debug_sections(FILE* destination)
+{
+	/* Everything in the output buffer has to be on disk first */
+	fflush(destination);
+	int out = fileno(destination);
+
+	/* debug_sections has been spliced into the output section list, so stop at the first section that is not ours */
+	struct output_section* o;
+	struct elf_section_header* p;
+	for(o = debug_sections; (NULL != o) && (NULL != o->pieces); o = o->next)
+	{
+		for(p = o->pieces; NULL != p; p = p->next_piece)
+		{
+			copy_file_bytes(p, out, o->offset + p->contents->starting_address);
+		}
+	}
+
+	/* Relocations are applied in memory, the same as for loaded sections */
+	struct segment* debug = map_debug_sections(out);
+	patch_relocations(debug_relocation_table, debug);
+	unmap_debug_sections(debug);
+}
@@ -0,0 +1,141 @@
+/* Copyright (C) 2020 Jeremiah Orians
+ * This file is part of M3-Meteoroid.
+ *
+ * M3-Meteoroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * M3-Meteoroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Meteoroid.h"
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// CONSTANT PERF_COUNTERS 5
+#define PERF_COUNTERS 5
+
+/* One file descriptor per counter, -1 for those the kernel would not give us */
+int* perf_fds;
+char** perf_names;
+int perf_available;
+
+int open_perf_counter(int type, int config)
+{
+	struct perf_event_attr* attr = calloc(1, sizeof(struct perf_event_attr));
+	attr->size = sizeof(struct perf_event_attr);
+	attr->type = type;
+	attr->config = config;
+
+	/* User space only, so it works under the default perf_event_paranoid */
+	attr->exclude_kernel = 1;
+	attr->exclude_hv = 1;
+	int r = syscall(SYS_perf_event_open, attr, 0, -1, -1, 0);
+	free(attr);
+	if(0 > r) return -1;
+	perf_available = TRUE;
+	return r;
+}
+
+void perf_counters_open()
+{
+	if(!PerfCounters || (NULL != perf_fds)) return;
+	perf_fds = calloc(PERF_COUNTERS, sizeof(int));
+	perf_names = calloc(PERF_COUNTERS, sizeof(char*));
+	perf_available = FALSE;
+
+	perf_names[0] = "cycles";
+	perf_fds[0] = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	perf_names[1] = "instructions";
+	perf_fds[1] = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	perf_names[2] = "llc-misses";
+	perf_fds[2] = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	perf_names[3] = "branch-misses";
+	perf_fds[3] = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+	perf_names[4] = "page-faults";
+	perf_fds[4] = open_perf_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+
+	/* Containers and locked down kernels often have none at all, the link goes on without them */
+	if(!perf_available) file_print("WARNING: perf events are not available, --perf-counters only reports times\n", stderr);
+}
+
+SCM read_perf_counter(int fd)
+{
+	long long value = 0;
+	if(0 > fd) return 0;
+	if(sizeof(long long) != read(fd, &value, sizeof(long long))) return 0;
+	return value;
+}
+
+SCM perf_clock()
+{
+	/* Wall time in nanoseconds, which needs no permission at all */
+	struct timespec* t = calloc(1, sizeof(struct timespec));
+	clock_gettime(CLOCK_MONOTONIC, t);
+	SCM r = (t->tv_sec * 1000000000) + t->tv_nsec;
+	free(t);
+	return r;
+}
+
+SCM* perf_begin()
+{
+	/* NULL when nothing is being measured, so callers need no checks of their own */
+	if(!PerfCounters) return NULL;
+	perf_counters_open();
+
+	/* The counters followed by the time */
+	SCM* r = calloc(PERF_COUNTERS + 1, sizeof(SCM));
+	int i;
+	for(i = 0; i < PERF_COUNTERS; i = i + 1) r[i] = read_perf_counter(perf_fds[i]);
+	r[PERF_COUNTERS] = perf_clock();
+	return r;
+}
+
+void print_count(SCM n, FILE* f)
+{
+	if(10 <= n) print_count(n / 10, f);
+	fputc('0' + (n % 10), f);
+}
+
+void perf_end(SCM* start, char* phase, char* name)
+{
+	if(NULL == start) return;
+
+	SCM now = perf_clock();
+	SCM* end = calloc(PERF_COUNTERS, sizeof(SCM));
+	int i;
+	for(i = 0; i < PERF_COUNTERS; i = i + 1) end[i] = read_perf_counter(perf_fds[i]);
+
+	/* perf: phase (file): time-ns N counter N ... */
+	file_print("perf: ", stderr);
+	file_print(phase, stderr);
+	if(NULL != name)
+	{
+		file_print(" (", stderr);
+		file_print(name, stderr);
+		file_print(")", stderr);
+	}
+	file_print(": time-ns ", stderr);
+	print_count(now - start[PERF_COUNTERS], stderr);
+	for(i = 0; i < PERF_COUNTERS; i = i + 1)
+	{
+		file_print(" ", stderr);
+		file_print(perf_names[i], stderr);
+		file_print(" ", stderr);
+		if(0 > perf_fds[i]) file_print("n/a", stderr);
+		else print_count(end[i] - start[i], stderr);
+	}
+	file_print("\n", stderr);
+
+	free(end);
+	free(start);
+}
@@ -0,0 +1,268 @@
+/* Copyright (C) 2020 Jeremiah Orians
+ * This file is part of M3-Meteoroid.
+ *
+ * M3-Meteoroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * M3-Meteoroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Meteoroid.h"
+
+// CONSTANT TASK_MAP_OBJECT 1
+#define TASK_MAP_OBJECT 1
+// CONSTANT TASK_OUTPUT_MAP 2
+#define TASK_OUTPUT_MAP 2
+// CONSTANT TASK_TEXT_LAYOUT 3
+#define TASK_TEXT_LAYOUT 3
+// CONSTANT TASK_DATA_LAYOUT 4
+#define TASK_DATA_LAYOUT 4
+// CONSTANT TASK_OBJECT_SYMBOLS 5
+#define TASK_OBJECT_SYMBOLS 5
+// CONSTANT TASK_SYMBOL_TABLE 6
+#define TASK_SYMBOL_TABLE 6
+// CONSTANT TASK_OBJECT_RELOCATIONS 7
+#define TASK_OBJECT_RELOCATIONS 7
+// CONSTANT TASK_RELOCATION_TABLE 8
+#define TASK_RELOCATION_TABLE 8
+
+void map_input_object(struct elf_object_file* f);
+void create_global_offset_table();
+struct output_section* sort_output_sections(struct output_section* head);
+struct output_section* find_output_section(char* name);
+struct placement* order_text_sections(struct output_section* text, struct elf_object_file* files, char* ordering_file, int call_graph, char* sample_file);
+SCM realign_text_segments(struct placement* p);
+void realign_data_segments(int page_size);
+int page_size();
+SCM align_up(SCM address, SCM alignment);
+struct symbol* object_symbols(struct elf_object_file* h);
+struct symbol* generate_symbol_table(struct elf_object_file* h);
+void resize_symbol_buckets(SCM count);
+struct symbol* allocate_common_symbols(struct elf_object_file* h, struct symbol* table);
+struct symbol* add_linker_symbols(struct symbol* table);
+struct relocation* collect_object_relocations(struct relocation* r, struct elf_object_file* f);
+struct relocation* collect_object_debug_relocations(struct relocation* r, struct elf_object_file* f);
+SCM* perf_begin();
+void perf_end(SCM* start, char* phase, char* name);
+
+/* The link is a graph of tasks, most of them for a single object. A task
+ * runs once everything it depends on is done, and anything ready runs in
+ * the order it was added, so every link does the same work in the same order.
+ * Tasks run one at a time; the graph only fixes what may follow what. */
+
+struct task* add_task(struct task* last, int kind, struct elf_object_file* f)
+{
+	struct task* r = calloc(1, sizeof(struct task));
+	r->kind = kind;
+	r->file = f;
+	if(NULL != last) last->next = r;
+	return r;
+}
+
+void depends_on(struct task* t, struct task* before)
+{
+	struct task_edge* e = calloc(1, sizeof(struct task_edge));
+	e->task = t;
+	e->next = before->dependents;
+	before->dependents = e;
+	t->waiting = t->waiting + 1;
+}
+
+struct relocation* last_relocation(struct relocation* r)
+{
+	if(NULL == r) return NULL;
+	while(NULL != r->next) r = r->next;
+	return r;
+}
+
+char* task_name(struct task* t)
+{
+	if(TASK_MAP_OBJECT == t->kind) return "map";
+	if(TASK_OUTPUT_MAP == t->kind) return "output map";
+	if(TASK_TEXT_LAYOUT == t->kind) return "text layout";
+	if(TASK_DATA_LAYOUT == t->kind) return "data layout";
+	if(TASK_OBJECT_SYMBOLS == t->kind) return "symbols";
+	if(TASK_SYMBOL_TABLE == t->kind) return "symbol table";
+	if(TASK_OBJECT_RELOCATIONS == t->kind) return "relocations";
+	return "relocation table";
+}
+
+void run_task(struct task* t)
+{
+	struct elf_object_file* f;
+	struct relocation* last;
+	if(TASK_MAP_OBJECT == t->kind) map_input_object(t->file);
+	else if(TASK_OUTPUT_MAP == t->kind)
+	{
+		/* Relaxation has seen every object, so it is known whether a GOT is left */
+		create_global_offset_table();
+		output_map = sort_output_sections(output_map);
+	}
+	else if(TASK_TEXT_LAYOUT == t->kind)
+	{
+		/* The first segment starts at file offset 0, so it must start on an aligned address */
+		BaseAddress = align_up(BaseAddress, SegmentAlign);
+		realign_text_segments(order_text_sections(find_output_section(".text"), t->file, OrderingFile, CallGraph, SampleFile));
+	}
+	else if(TASK_DATA_LAYOUT == t->kind) realign_data_segments(page_size());
+	else if(TASK_OBJECT_SYMBOLS == t->kind) t->file->linked_symbols = object_symbols(t->file);
+	else if(TASK_SYMBOL_TABLE == t->kind)
+	{
+		/* Every definition is known by now, so the index can be sized once */
+		SCM count = 0;
+		struct symbol* s;
+		for(f = t->file; NULL != f; f = f->next)
+		{
+			for(s = f->linked_symbols; NULL != s; s = s->next) count = count + 1;
+		}
+		resize_symbol_buckets(count);
+		symbol_table = generate_symbol_table(t->file);
+		symbol_table = allocate_common_symbols(t->file, symbol_table);
+		symbol_table = add_linker_symbols(symbol_table);
+	}
+	else if(TASK_OBJECT_RELOCATIONS == t->kind)
+	{
+		t->file->relocations = collect_object_relocations(NULL, t->file);
+		t->file->debug_relocations = collect_object_debug_relocations(NULL, t->file);
+	}
+	else if(TASK_RELOCATION_TABLE == t->kind)
+	{
+		/* Stitched together in the order a single walk over the files would have produced,
+		 * keeping the end of the table so each file's list is only walked once */
+		last = last_relocation(relocation_table);
+		for(f = t->file; NULL != f; f = f->next)
+		{
+			if(NULL != f->relocations)
+			{
+				if(NULL == last) relocation_table = f->relocations;
+				else last->next = f->relocations;
+				last = last_relocation(f->relocations);
+			}
+			if(NULL != f->debug_relocations)
+			{
+				last_relocation(f->debug_relocations)->next = debug_relocation_table;
+				debug_relocation_table = f->debug_relocations;
+			}
+			f->relocations = NULL;
+			f->debug_relocations = NULL;
+		}
+	}
+	else
+	{
+		file_print("Unknown link task\nAborting to avoid problems\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void run_tasks(struct task* head)
+{
+	struct task* ready = NULL;
+	struct task* tail = NULL;
+	struct task* t;
+	struct task_edge* e;
+	SCM count = 0;
+	SCM done = 0;
+	struct elf_object_file* hold = current_file;
+	SCM* counters;
+	for(t = head; NULL != t; t = t->next)
+	{
+		count = count + 1;
+		if(0 == t->waiting)
+		{
+			if(NULL == tail) ready = t;
+			else tail->next_ready = t;
+			tail = t;
+		}
+	}
+
+	while(NULL != ready)
+	{
+		t = ready;
+		ready = ready->next_ready;
+		if(NULL == ready) tail = NULL;
+		counters = perf_begin();
+		run_task(t);
+		if((NULL != t->file) && (t->kind != TASK_TEXT_LAYOUT) && (t->kind != TASK_SYMBOL_TABLE) && (t->kind != TASK_RELOCATION_TABLE)) perf_end(counters, task_name(t), t->file->name);
+		else perf_end(counters, task_name(t), NULL);
+		done = done + 1;
+
+		for(e = t->dependents; NULL != e; e = e->next)
+		{
+			e->task->waiting = e->task->waiting - 1;
+			if(0 == e->task->waiting)
+			{
+				if(NULL == tail) ready = e->task;
+				else tail->next_ready = e->task;
+				tail = e->task;
+			}
+		}
+	}
+
+	require(count == done, "Link tasks depend on each other in a loop\n");
+	current_file = hold;
+}
+
+struct task* build_link_tasks(struct elf_object_file* files)
+{
+	struct elf_object_file* f;
+	struct task* last = NULL;
+	struct task* previous = NULL;
+	struct task* head = NULL;
+	struct task* t;
+
+	/* Objects are mapped one after another so their pieces land in command line order */
+	for(f = files; NULL != f; f = f->next)
+	{
+		last = add_task(last, TASK_MAP_OBJECT, f);
+		if(NULL == head) head = last;
+		if(NULL != previous) depends_on(last, previous);
+		previous = last;
+	}
+
+	/* Nothing can be placed until every object has said what it brings */
+	struct task* output_map_task = add_task(last, TASK_OUTPUT_MAP, NULL);
+	if(NULL == head) head = output_map_task;
+	if(NULL != previous) depends_on(output_map_task, previous);
+
+	struct task* text = add_task(output_map_task, TASK_TEXT_LAYOUT, files);
+	depends_on(text, output_map_task);
+	struct task* data = add_task(text, TASK_DATA_LAYOUT, NULL);
+	depends_on(data, text);
+
+	/* Each object's definitions only need the layout, they are merged afterwards */
+	struct task* symbols = add_task(NULL, TASK_SYMBOL_TABLE, files);
+	last = data;
+	for(f = files; NULL != f; f = f->next)
+	{
+		t = add_task(last, TASK_OBJECT_SYMBOLS, f);
+		depends_on(t, data);
+		depends_on(symbols, t);
+		last = t;
+	}
+	last->next = symbols;
+	depends_on(symbols, data);
+	last = symbols;
+
+	/* An object's relocations can be resolved once every symbol is, the second pass of --low-memory does its own */
+	if(LowMemory) return head;
+	struct task* relocations = add_task(NULL, TASK_RELOCATION_TABLE, files);
+	for(f = files; NULL != f; f = f->next)
+	{
+		t = add_task(last, TASK_OBJECT_RELOCATIONS, f);
+		depends_on(t, symbols);
+		depends_on(relocations, t);
+		last = t;
+	}
+	last->next = relocations;
+	depends_on(relocations, symbols);
+
+	return head;
+}
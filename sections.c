@@ -0,0 +1,468 @@
+/* Copyright (C) 2020 Jeremiah Orians
+ * This file is part of M3-Meteoroid.
+ *
+ * M3-Meteoroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * M3-Meteoroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Meteoroid.h"
+
+// CONSTANT COMDAT_SHARDS 4096
+#define COMDAT_SHARDS 4096
+
+char* read_token(FILE* f);
+FILE* open_ordering_file(char* name);
+SCM align_up(SCM address, SCM alignment);
+struct segment* view_segment(struct segment* f, SCM offset, SCM size, char* name);
+struct segment* zero_fill_segment(SCM size, char* name);
+struct elf_relocation* read_relocation_entries(struct segment* f, struct elf_section_header* s);
+struct elf_adjusted_relocation* read_adjusted_relocation_entries(struct segment* f, struct elf_section_header* s);
+struct elf_section_header* find_section_by_number(struct elf_object_file* f, int number);
+void read_object_debug_sections(struct elf_object_file* f);
+void relax_object_relocations(struct elf_object_file* f);
+void release_object(struct elf_object_file* f);
+void load_object_symbols(struct elf_object_file* f);
+SCM read_word(struct segment* f, char* failure);
+SCM symbol_name_hash(char* name);
+
+/* Rules are kept in a character trie so classifying a name is a single walk over it */
+struct section_rule* find_rule_child(struct section_rule* node, int c)
+{
+	struct section_rule* i = node->children;
+	while(NULL != i)
+	{
+		if(c == i->c) return i;
+		i = i->next;
+	}
+	return NULL;
+}
+
+struct section_rule* add_rule_child(struct section_rule* node, int c)
+{
+	struct section_rule* r = find_rule_child(node, c);
+	if(NULL != r) return r;
+
+	r = calloc(1, sizeof(struct section_rule));
+	r->c = c;
+	r->next = node->children;
+	node->children = r;
+	return r;
+}
+
+void add_section_rule(char* pattern, char* output)
+{
+	/* A trailing * matches every name that starts with what comes before it */
+	if(NULL == section_rules) section_rules = calloc(1, sizeof(struct section_rule));
+	struct section_rule* node = section_rules;
+	int i = 0;
+	while((0 != pattern[i]) && !(('*' == pattern[i]) && (0 == pattern[i + 1])))
+	{
+		node = add_rule_child(node, pattern[i]);
+		i = i + 1;
+	}
+
+	/* Later rules replace earlier ones for the same pattern */
+	if('*' == pattern[i]) node->prefix = output;
+	else node->exact = output;
+}
+
+void default_section_rules()
+{
+	add_section_rule(".text", ".text");
+	add_section_rule(".text.*", ".text");
+	add_section_rule(".rodata", ".rodata");
+	add_section_rule(".rodata.*", ".rodata");
+	add_section_rule(".data.rel.ro", ".data.rel.ro");
+	add_section_rule(".data.rel.ro.*", ".data.rel.ro");
+	add_section_rule(".data", ".data");
+	add_section_rule(".data.*", ".data");
+	add_section_rule(".bss", ".bss");
+	add_section_rule(".bss.*", ".bss");
+
+	/* Nothing reads these in a static image */
+	add_section_rule(".note.GNU-stack", "/DISCARD/");
+	add_section_rule(".note.gnu.property", "/DISCARD/");
+}
+
+void read_section_rules(char* name)
+{
+	/* Lines of: pattern output_section */
+	FILE* f = open_ordering_file(name);
+	char* pattern = read_token(f);
+	char* output;
+	while(NULL != pattern)
+	{
+		output = read_token(f);
+		require(NULL != output, "Section map file has a pattern without an output section\n");
+		add_section_rule(pattern, output);
+		pattern = read_token(f);
+	}
+	fclose(f);
+}
+
+char* classify_section(char* name)
+{
+	/* The longest matching pattern wins; NULL when nothing matches */
+	struct section_rule* node = section_rules;
+	char* r = NULL;
+	int i = 0;
+	while(NULL != node)
+	{
+		if(NULL != node->prefix) r = node->prefix;
+		if(0 == name[i])
+		{
+			if(NULL != node->exact) r = node->exact;
+			return r;
+		}
+		node = find_rule_child(node, name[i]);
+		i = i + 1;
+	}
+	return r;
+}
+
+struct output_section* find_output_section(char* name)
+{
+	struct output_section* i = output_map;
+	while(NULL != i)
+	{
+		/* COMDAT members kept whole for -r are never shared */
+		if((NULL == i->group) && match(name, i->name)) return i;
+		i = i->next;
+	}
+	return NULL;
+}
+
+struct output_section* new_output_section(char* name, int type, SCM flags)
+{
+	/* Appended in order of first appearance */
+	struct output_section* r = calloc(1, sizeof(struct output_section));
+	r->name = name;
+	r->type = type;
+	r->flags = flags;
+	r->alignment = 1;
+
+	/* Sorting can move the last section, then the tail has to be found again */
+	if(NULL == output_map) output_map = r;
+	else if((NULL != output_map_tail) && (NULL == output_map_tail->next)) output_map_tail->next = r;
+	else
+	{
+		struct output_section* i = output_map;
+		while(NULL != i->next) i = i->next;
+		i->next = r;
+	}
+	output_map_tail = r;
+	return r;
+}
+
+void zero_fill_piece(struct elf_section_header* p)
+{
+	if(NULL == p->contents->contents) p->contents->contents = calloc(p->sh_size + 4, sizeof(char));
+}
+
+void zero_fill_pieces(struct output_section* o)
+{
+	/* Once an output section has file contents its .bss style pieces need real zeros */
+	struct elf_section_header* p;
+	for(p = o->pieces; NULL != p; p = p->next_piece) zero_fill_piece(p);
+}
+
+void add_output_piece(struct output_section* o, struct elf_section_header* s, struct segment* in)
+{
+	s->output = o;
+
+	/* SHT_NOBITS takes up no space in the file; the rest is read in place from
+	 * the private input mapping, so only pages that get written are ever copied */
+	if(8 == s->sh_type) s->contents = zero_fill_segment(s->sh_size, s->sh_name);
+	else s->contents = view_segment(in, s->sh_offset, s->sh_size, s->sh_name);
+
+	/* Only SHF_WRITE, SHF_ALLOC and SHF_EXECINSTR carry over */
+	o->flags = o->flags | (s->sh_flags & 7);
+	if(o->alignment < s->sh_addralign) o->alignment = s->sh_addralign;
+
+	if(NULL == o->pieces) o->pieces = s;
+	else o->last_piece->next_piece = s;
+	o->last_piece = s;
+
+	/* Earlier pieces only need filling the first time, later ones as they come */
+	if((8 == o->type) && (8 != s->sh_type))
+	{
+		o->type = s->sh_type;
+		zero_fill_pieces(o);
+	}
+	else if(8 != o->type) zero_fill_piece(s);
+}
+
+void add_output_group(struct elf_section_header* group)
+{
+	if(NULL != group->output) return;
+
+	/* SHT_GROUP, filled in once the members and the signature have indices */
+	struct output_section* r = calloc(1, sizeof(struct output_section));
+	r->name = ".group";
+	r->type = 17;
+	r->alignment = 4;
+	r->entry_size = 4;
+	r->group = group;
+	group->output = r;
+
+	if(NULL == output_groups) output_groups = r;
+	else output_groups_tail->next = r;
+	output_groups_tail = r;
+}
+
+void map_section(struct elf_object_file* f, struct elf_section_header* s)
+{
+	/* Only SHF_ALLOC sections end up in memory, and only one copy of each COMDAT group */
+	if(0 == (s->sh_flags & 2)) return;
+	if(s->discarded) return;
+
+	/* A relocatable output keeps each COMDAT member whole, so the final link can still drop it */
+	struct output_section* o;
+	if(Relocatable && (NULL != s->group))
+	{
+		add_output_group(s->group);
+		/* SHF_GROUP */
+		o = new_output_section(s->sh_name, s->sh_type, 0x200);
+		o->group = s->group;
+		add_output_piece(o, s, f->input);
+		return;
+	}
+
+	/* Sections no rule mentions keep their own name */
+	char* name = classify_section(s->sh_name);
+	if(NULL == name) name = s->sh_name;
+	if(match("/DISCARD/", name)) return;
+
+	o = find_output_section(name);
+	if(NULL == o) o = new_output_section(name, s->sh_type, 0);
+	add_output_piece(o, s, f->input);
+}
+
+void map_sections_in_order(struct elf_object_file* f, struct elf_section_header* s)
+{
+	/* Sections are kept highest index first, pieces go in lowest index first */
+	if(NULL == s) return;
+	map_sections_in_order(f, s->next);
+	map_section(f, s);
+}
+
+void read_object_relocations(struct elf_object_file* f)
+{
+	struct elf_section_header* s;
+
+	/* SHT_REL and SHT_RELA sections name the section they apply to in sh_info */
+	struct elf_section_header* target;
+	for(s = f->sections; NULL != s; s = s->next)
+	{
+		if((9 == s->sh_type) || (4 == s->sh_type))
+		{
+			target = find_section_by_number(f, s->sh_info);
+			if((NULL != target) && (NULL != target->output))
+			{
+				require(0 == (target->sh_flags & 0x800), "Relocations against a compressed debug section can not be applied without decompressing it\n");
+				if(9 == s->sh_type) target->r = read_relocation_entries(f->input, s);
+				else target->ar = read_adjusted_relocation_entries(f->input, s);
+			}
+		}
+	}
+}
+
+char* group_signature(struct elf_object_file* f, struct elf_section_header* group)
+{
+	/* The group is named by the symbol sh_info points at */
+	if(group->sh_info < f->symbol_count) return f->symbol_index[group->sh_info]->st_name;
+
+	file_print("COMDAT group without a signature symbol in: ", stderr);
+	file_print(f->name, stderr);
+	file_print("\nAborting to prevent issues\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+int claim_comdat_group(char* signature, struct elf_object_file* f)
+{
+	/* The first object to bring a group keeps it */
+	if(NULL == comdat_groups) comdat_groups = calloc(COMDAT_SHARDS, sizeof(struct comdat_group*));
+	SCM shard = symbol_name_hash(signature) & (COMDAT_SHARDS - 1);
+	struct comdat_group* g;
+	for(g = comdat_groups[shard]; NULL != g; g = g->next)
+	{
+		if(match(signature, g->signature)) return f == g->file;
+	}
+
+	g = calloc(1, sizeof(struct comdat_group));
+	g->signature = signature;
+	g->file = f;
+	g->next = comdat_groups[shard];
+	comdat_groups[shard] = g;
+	return TRUE;
+}
+
+void discard_comdat_group(struct elf_object_file* f, struct elf_section_header* group)
+{
+	/* A flags word followed by the section numbers of the members */
+	struct elf_section_header* s;
+	SCM i;
+	read_offset = group->sh_offset + 4;
+	for(i = 4; i < group->sh_size; i = i + 4)
+	{
+		s = find_section_by_number(f, read_word(f->input, "Hit EOF while attempting to read a group member\n"));
+		if(NULL != s) s->discarded = TRUE;
+	}
+}
+
+void keep_comdat_group(struct elf_object_file* f, struct elf_section_header* group)
+{
+	/* Only a relocatable output needs to know which group a kept section came from */
+	struct elf_section_header* s;
+	SCM i;
+	read_offset = group->sh_offset + 4;
+	for(i = 4; i < group->sh_size; i = i + 4)
+	{
+		s = find_section_by_number(f, read_word(f->input, "Hit EOF while attempting to read a group member\n"));
+		if(NULL != s) s->group = group;
+	}
+}
+
+void resolve_comdat_groups(struct elf_object_file* f)
+{
+	/* Done before anything is mapped, so the losing copies are never looked at again */
+	struct elf_section_header* s;
+	for(s = f->sections; NULL != s; s = s->next)
+	{
+		/* SHT_GROUP with GRP_COMDAT */
+		if(17 == s->sh_type)
+		{
+			read_offset = s->sh_offset;
+			if(0 != (1 & read_word(f->input, "Hit EOF while attempting to read group flags\n")))
+			{
+				if(!claim_comdat_group(group_signature(f, s), f)) discard_comdat_group(f, s);
+				else if(Relocatable) keep_comdat_group(f, s);
+			}
+		}
+	}
+}
+
+void map_input_object(struct elf_object_file* f)
+{
+	/* Objects are mapped in command line order; relocation symbols are looked up in current_file */
+	current_file = f;
+	load_object_symbols(f);
+	resolve_comdat_groups(f);
+	map_sections_in_order(f, f->sections);
+	if(DEBUG) read_object_debug_sections(f);
+	read_object_relocations(f);
+	/* A relocatable output leaves GOT references for the final link */
+	if(!Relocatable) relax_object_relocations(f);
+
+	/* Only the headers and symbols are kept until the second pass */
+	if(LowMemory) release_object(f);
+}
+
+int segment_rank(struct output_section* o)
+{
+	/* Code, then read only data in the first PT_LOAD; data, then zero fill in the second */
+	if(0 == (o->flags & 1))
+	{
+		if(0 != (o->flags & 4)) return 0;
+		return 1;
+	}
+	if(8 != o->type) return 2;
+	return 3;
+}
+
+struct output_section* sort_output_sections(struct output_section* head)
+{
+	if((NULL == head) || (NULL == head->next)) return head;
+
+	/* Split the list in half */
+	struct output_section* slow = head;
+	struct output_section* fast = head->next;
+	while((NULL != fast) && (NULL != fast->next))
+	{
+		slow = slow->next;
+		fast = fast->next->next;
+	}
+	struct output_section* back = slow->next;
+	slow->next = NULL;
+
+	struct output_section* a = sort_output_sections(head);
+	struct output_section* b = sort_output_sections(back);
+
+	/* Merge the sorted halves back together, keeping first appearance order within a rank */
+	struct output_section* r = NULL;
+	struct output_section* tail = NULL;
+	struct output_section* hold;
+	while((NULL != a) || (NULL != b))
+	{
+		if((NULL == b) || ((NULL != a) && (segment_rank(a) <= segment_rank(b))))
+		{
+			hold = a;
+			a = a->next;
+		}
+		else
+		{
+			hold = b;
+			b = b->next;
+		}
+
+		if(NULL == tail) r = hold;
+		else tail->next = hold;
+		tail = hold;
+	}
+	tail->next = NULL;
+
+	return r;
+}
+
+void reorder_output_pieces(struct output_section* o, struct placement* p)
+{
+	/* Relink the pieces so the list stays in address order */
+	o->pieces = NULL;
+	o->last_piece = NULL;
+	while(NULL != p)
+	{
+		if(NULL == o->pieces) o->pieces = p->section;
+		else o->last_piece->next_piece = p->section;
+		o->last_piece = p->section;
+		p = p->next;
+	}
+	if(NULL != o->last_piece) o->last_piece->next_piece = NULL;
+}
+
+SCM piece_alignment(struct output_section* o, struct elf_section_header* p)
+{
+	/* --function-align only ever raises the alignment of code */
+	if((0 != (o->flags & 4)) && (FunctionAlign > p->sh_addralign)) return FunctionAlign;
+	return p->sh_addralign;
+}
+
+SCM layout_output_section(struct output_section* o, SCM address)
+{
+	struct elf_section_header* p;
+	for(p = o->pieces; NULL != p; p = p->next_piece)
+	{
+		if(o->alignment < piece_alignment(o, p)) o->alignment = piece_alignment(o, p);
+	}
+
+	/* Each piece starts on its own sh_addralign boundary, the gaps are filled when written */
+	o->address = align_up(address, o->alignment);
+	address = o->address;
+	for(p = o->pieces; NULL != p; p = p->next_piece)
+	{
+		address = align_up(address, piece_alignment(o, p));
+		p->contents->starting_address = address;
+		address = address + p->contents->size;
+	}
+	o->size = address - o->address;
+	return address;
+}
@@ -0,0 +1,133 @@
+/* Copyright (C) 2020 Jeremiah Orians
+ * This file is part of M3-Meteoroid.
+ *
+ * M3-Meteoroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * M3-Meteoroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Meteoroid.h"
+#include <sys/mman.h>
+
+struct segment* get_file(FILE* f, char* name);
+void read_object_relocations(struct elf_object_file* f);
+void relax_object_relocations(struct elf_object_file* f);
+struct relocation* collect_object_relocations(struct relocation* r, struct elf_object_file* f);
+struct relocation* collect_object_debug_relocations(struct relocation* r, struct elf_object_file* f);
+int piece_in_input(struct elf_section_header* p);
+void place_piece(struct segment* f, struct elf_section_header* p);
+void copy_file_bytes(struct elf_section_header* p, int out, SCM destination);
+void apply_relocations();
+void patch_relocations(struct relocation* r, struct segment* debug);
+struct segment* map_debug_sections(int fd);
+void unmap_debug_sections(struct segment* debug);
+
+/* --low-memory links in two passes. The first keeps only the headers, the
+ * symbols and the layout of each object; the second maps the objects again
+ * one at a time, writes their sections into place and lets them go. */
+
+void free_relocations(struct relocation* r)
+{
+	struct relocation* hold;
+	while(NULL != r)
+	{
+		hold = r->next;
+		free(r);
+		r = hold;
+	}
+}
+
+void free_object_relocations(struct elf_section_header* s)
+{
+	struct elf_relocation* r;
+	struct elf_adjusted_relocation* a;
+	while(NULL != s->r)
+	{
+		r = s->r->next;
+		free(s->r);
+		s->r = r;
+	}
+	while(NULL != s->ar)
+	{
+		a = s->ar->next;
+		free(s->ar);
+		s->ar = a;
+	}
+}
+
+void release_object(struct elf_object_file* f)
+{
+	struct elf_section_header* s;
+	for(s = f->sections; NULL != s; s = s->next) free_object_relocations(s);
+
+	/* The section views point into the mapping, they are stale until view_object */
+	munmap(f->input->contents, f->input->size);
+	f->input->contents = NULL;
+}
+
+void view_object(struct elf_object_file* f)
+{
+	struct segment* in = get_file(fopen(f->name, "r"), f->name);
+	require(in->size == f->input->size, "Input file changed size between passes\n");
+	f->input->contents = in->contents;
+	free(in);
+
+	struct elf_section_header* s;
+	for(s = f->sections; NULL != s; s = s->next)
+	{
+		if((NULL != s->output) && piece_in_input(s)) s->contents->contents = f->input->contents + s->sh_offset;
+	}
+}
+
+void stream_object(struct elf_object_file* f, struct segment* out, int fd, struct segment* debug)
+{
+	/* Relaxation only depends on the object, so it rewrites the same instructions as the first pass did */
+	current_file = f;
+	view_object(f);
+	read_object_relocations(f);
+	relax_object_relocations(f);
+
+	struct relocation* debug_relocations = collect_object_debug_relocations(NULL, f);
+	relocation_table = collect_object_relocations(NULL, f);
+
+	struct elf_section_header* s;
+	for(s = f->sections; NULL != s; s = s->next)
+	{
+		if((NULL != s->output) && piece_in_input(s))
+		{
+			if(0 != (s->sh_flags & 2)) place_piece(out, s);
+			else copy_file_bytes(s, fd, s->output->offset + s->contents->starting_address);
+		}
+	}
+
+	apply_relocations();
+	patch_relocations(debug_relocations, debug);
+
+	free_relocations(relocation_table);
+	relocation_table = NULL;
+	free_relocations(debug_relocations);
+	release_object(f);
+}
+
+void stream_objects(struct elf_object_file* f, struct segment* out, FILE* destination)
+{
+	struct elf_object_file* hold = current_file;
+	fflush(destination);
+	struct segment* debug = map_debug_sections(fileno(destination));
+	while(NULL != f)
+	{
+		stream_object(f, out, fileno(destination), debug);
+		f = f->next;
+	}
+	unmap_debug_sections(debug);
+	current_file = hold;
+}
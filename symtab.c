@@ -0,0 +1,405 @@
+/* Copyright (C) 2020 Jeremiah Orians
+ * This file is part of M3-Meteoroid.
+ *
+ * M3-Meteoroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * M3-Meteoroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Meteoroid.h"
+
+// CONSTANT MIN_SYMBOL_BUCKETS 1024
+#define MIN_SYMBOL_BUCKETS 1024
+
+void put_char(int c, struct segment* f);
+void write_half(struct segment* f, int o);
+void write_word(struct segment* f, SCM o);
+void write_register(struct segment* f, SCM o);
+int symbol_is_local(struct symbol* s);
+
+SCM string_length(char* s)
+{
+	SCM i = 0;
+	while(0 != s[i]) i = i + 1;
+	return i;
+}
+
+SCM symbol_name_hash(char* name)
+{
+	/* FNV-1a, kept to 32 bits so every host builds the same chains */
+	SCM h = 2166136261;
+	int i = 0;
+	while(0 != name[i])
+	{
+		h = ((h ^ (name[i] & 0xFF)) * 16777619) & 0xFFFFFFFF;
+		i = i + 1;
+	}
+	return h;
+}
+
+struct symbol* find_global_symbol(char* name)
+{
+	/* Only symbols other files can see are indexed */
+	if(NULL == symbol_buckets) return NULL;
+	struct symbol* s = symbol_buckets[symbol_name_hash(name) & (symbol_bucket_count - 1)];
+	while(NULL != s)
+	{
+		if(match(name, s->name)) return s;
+		s = s->next_in_bucket;
+	}
+	return NULL;
+}
+
+void resize_symbol_buckets(SCM count)
+{
+	/* A power of two at least as large as count, so chains stay about one long */
+	SCM size = MIN_SYMBOL_BUCKETS;
+	while(size < count) size = size * 2;
+	if(size <= symbol_bucket_count) return;
+
+	struct symbol** old = symbol_buckets;
+	SCM old_count = symbol_bucket_count;
+	symbol_buckets = calloc(size, sizeof(struct symbol*));
+	symbol_bucket_count = size;
+
+	/* Each chain keeps its order, so the first definition is still the one found */
+	SCM i;
+	struct symbol* s;
+	struct symbol* next;
+	struct symbol* reversed;
+	SCM bucket;
+	for(i = 0; i < old_count; i = i + 1)
+	{
+		reversed = NULL;
+		for(s = old[i]; NULL != s; s = next)
+		{
+			next = s->next_in_bucket;
+			s->next_in_bucket = reversed;
+			reversed = s;
+		}
+		for(s = reversed; NULL != s; s = next)
+		{
+			next = s->next_in_bucket;
+			bucket = symbol_name_hash(s->name) & (size - 1);
+			s->next_in_bucket = symbol_buckets[bucket];
+			symbol_buckets[bucket] = s;
+		}
+	}
+	free(old);
+}
+
+void publish_symbol(struct symbol* s)
+{
+	/* Local symbols only need to be unique within their own file */
+	if(symbol_is_local(s)) return;
+
+	/* Symbols are published in the same order as they are added to the table,
+	 * so the first definition always wins and the second is the one reported */
+	if(NULL != find_global_symbol(s->name))
+	{
+		file_print("duplicate definition found for: ", stderr);
+		file_print(s->name, stderr);
+		file_print("\nAborting to prevent issues\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Sized up front from the inputs, but commons and linker symbols may still follow */
+	global_symbol_count = global_symbol_count + 1;
+	if(global_symbol_count > symbol_bucket_count) resize_symbol_buckets(2 * global_symbol_count);
+
+	SCM bucket = symbol_name_hash(s->name) & (symbol_bucket_count - 1);
+	s->next_in_bucket = symbol_buckets[bucket];
+	symbol_buckets[bucket] = s;
+}
+
+struct merged_string* add_merged_string(struct merged_string* list, char* name, struct symbol* symbol, struct output_section* section)
+{
+	struct merged_string* r = calloc(1, sizeof(struct merged_string));
+	r->name = name;
+	r->length = string_length(name);
+	r->symbol = symbol;
+	r->section = section;
+	r->next = list;
+	return r;
+}
+
+int reversed_before(struct merged_string* a, struct merged_string* b)
+{
+	/* Compare from the last character back, longer strings first on a tie,
+	 * so every string comes right after one it is a suffix of */
+	SCM i = 1;
+	int ca;
+	int cb;
+	while((i <= a->length) && (i <= b->length))
+	{
+		ca = a->name[a->length - i] & 0xFF;
+		cb = b->name[b->length - i] & 0xFF;
+		if(ca != cb) return ca > cb;
+		i = i + 1;
+	}
+	return a->length >= b->length;
+}
+
+struct merged_string* sort_merged_strings(struct merged_string* head)
+{
+	if((NULL == head) || (NULL == head->next)) return head;
+
+	/* Split the list in half */
+	struct merged_string* slow = head;
+	struct merged_string* fast = head->next;
+	while((NULL != fast) && (NULL != fast->next))
+	{
+		slow = slow->next;
+		fast = fast->next->next;
+	}
+	struct merged_string* back = slow->next;
+	slow->next = NULL;
+
+	struct merged_string* a = sort_merged_strings(head);
+	struct merged_string* b = sort_merged_strings(back);
+
+	/* Merge the sorted halves back together */
+	struct merged_string* r = NULL;
+	struct merged_string* tail = NULL;
+	struct merged_string* hold;
+	while((NULL != a) || (NULL != b))
+	{
+		if((NULL == b) || ((NULL != a) && reversed_before(a, b)))
+		{
+			hold = a;
+			a = a->next;
+		}
+		else
+		{
+			hold = b;
+			b = b->next;
+		}
+
+		if(NULL == tail) r = hold;
+		else tail->next = hold;
+		tail = hold;
+	}
+	tail->next = NULL;
+
+	return r;
+}
+
+int is_suffix(struct merged_string* whole, struct merged_string* part)
+{
+	if(part->length > whole->length) return FALSE;
+	SCM i;
+	for(i = 1; i <= part->length; i = i + 1)
+	{
+		if(whole->name[whole->length - i] != part->name[part->length - i]) return FALSE;
+	}
+	return TRUE;
+}
+
+struct segment* generate_merged_strings(struct merged_string* list, char* name)
+{
+	/* Offset 0 is always the empty string */
+	SCM size = 1;
+	struct merged_string* prev = NULL;
+	struct merged_string* i;
+	list = sort_merged_strings(list);
+	for(i = list; NULL != i; i = i->next)
+	{
+		if(0 == i->length) i->offset = 0;
+		else if((NULL != prev) && is_suffix(prev, i)) i->offset = prev->offset + prev->length - i->length;
+		else
+		{
+			i->offset = size;
+			size = size + i->length + 1;
+		}
+		if(0 != i->length) prev = i;
+
+		if(NULL != i->symbol) i->symbol->name_offset = i->offset;
+		if(NULL != i->section) i->section->name_offset = i->offset;
+	}
+
+	struct segment* r = calloc(1, sizeof(struct segment));
+	r->name = name;
+	r->size = size;
+	r->contents = calloc(size, sizeof(char));
+	SCM j;
+	for(i = list; NULL != i; i = i->next)
+	{
+		for(j = 0; j < i->length; j = j + 1) r->contents[i->offset + j] = i->name[j];
+	}
+	return r;
+}
+
+struct segment* generate_output_strtab(struct symbol* table)
+{
+	struct merged_string* list = NULL;
+	while(NULL != table)
+	{
+		list = add_merged_string(list, table->name, table, NULL);
+		table = table->next;
+	}
+	return generate_merged_strings(list, ".strtab");
+}
+
+struct segment* generate_section_name_table(struct output_section* sections)
+{
+	struct merged_string* list = NULL;
+	while(NULL != sections)
+	{
+		list = add_merged_string(list, sections->name, NULL, sections);
+		sections = sections->next;
+	}
+	return generate_merged_strings(list, ".shstrtab");
+}
+
+SCM count_local_symbols(struct symbol* table)
+{
+	SCM r = 0;
+	while(NULL != table)
+	{
+		if(symbol_is_local(table)) r = r + 1;
+		table = table->next;
+	}
+	return r;
+}
+
+SCM symbol_entry_size()
+{
+	if(largeint) return 24;
+	return 16;
+}
+
+int output_section_index(struct symbol* s, struct output_section* sections)
+{
+	/* Absolute symbols */
+	if(NULL == s->section) return SHN_ABS;
+	if(NULL != s->output) return s->output->index;
+
+	while(NULL != sections)
+	{
+		if(match(s->section, sections->name)) return sections->index;
+		sections = sections->next;
+	}
+	return SHN_ABS;
+}
+
+int output_symbol_shndx(struct symbol* s, struct output_section* sections)
+{
+	/* Sections past SHN_LORESERVE are named in .symtab_shndx instead */
+	int r = output_section_index(s, sections);
+	if(SHN_ABS == r) return 0xFFF1;
+	if(SHN_LORESERVE <= r) return SHN_XINDEX;
+	return r;
+}
+
+SCM output_symbol_value(struct symbol* s, struct output_section* sections)
+{
+	/* In a relocatable output symbols are offsets into their section */
+	if(!Relocatable || (NULL == s->section)) return s->address;
+	if(NULL != s->output) return s->address - s->output->address;
+
+	while(NULL != sections)
+	{
+		if(match(s->section, sections->name)) return s->address - sections->address;
+		sections = sections->next;
+	}
+	return s->address;
+}
+
+void write_output_symbol(struct segment* f, struct symbol* s, struct output_section* sections)
+{
+	write_word(f, s->name_offset);
+	if(largeint)
+	{
+		put_char(s->info, f);
+		put_char(s->other, f);
+		write_half(f, output_symbol_shndx(s, sections));
+		write_register(f, output_symbol_value(s, sections));
+		write_register(f, s->size);
+	}
+	else
+	{
+		write_register(f, output_symbol_value(s, sections));
+		write_register(f, s->size);
+		put_char(s->info, f);
+		put_char(s->other, f);
+		write_half(f, output_symbol_shndx(s, sections));
+	}
+}
+
+int needs_symtab_shndx(struct symbol* table, struct output_section* sections)
+{
+	while(NULL != table)
+	{
+		if(SHN_XINDEX == output_symbol_shndx(table, sections)) return TRUE;
+		table = table->next;
+	}
+	return FALSE;
+}
+
+struct segment* generate_output_symtab_shndx(struct symbol* table, struct output_section* sections)
+{
+	/* One word per symbol in .symtab order, zero unless its st_shndx is SHN_XINDEX */
+	if(!needs_symtab_shndx(table, sections)) return NULL;
+
+	SCM count = 1;
+	struct symbol* i;
+	for(i = table; NULL != i; i = i->next) count = count + 1;
+
+	struct segment* r = calloc(1, sizeof(struct segment));
+	r->name = ".symtab_shndx";
+	r->size = count * 4;
+	r->contents = calloc(r->size, sizeof(char));
+	for(i = table; NULL != i; i = i->next)
+	{
+		if(SHN_XINDEX == output_symbol_shndx(i, sections))
+		{
+			write_offset = i->symtab_index * 4;
+			write_word(r, output_section_index(i, sections));
+		}
+	}
+	return r;
+}
+
+struct segment* generate_output_symtab(struct symbol* table, struct output_section* sections)
+{
+	SCM count = 1;
+	struct symbol* i;
+	for(i = table; NULL != i; i = i->next) count = count + 1;
+
+	struct segment* r = calloc(1, sizeof(struct segment));
+	r->name = ".symtab";
+	r->size = count * symbol_entry_size();
+	r->contents = calloc(r->size, sizeof(char));
+
+	/* Entry 0 stays all zeros, then all of the locals have to come before any globals */
+	write_offset = symbol_entry_size();
+	count = 1;
+	for(i = table; NULL != i; i = i->next)
+	{
+		if(symbol_is_local(i))
+		{
+			i->symtab_index = count;
+			count = count + 1;
+			write_output_symbol(r, i, sections);
+		}
+	}
+	for(i = table; NULL != i; i = i->next)
+	{
+		if(!symbol_is_local(i))
+		{
+			i->symtab_index = count;
+			count = count + 1;
+			write_output_symbol(r, i, sections);
+		}
+	}
+	return r;
+}
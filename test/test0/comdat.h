@@ -0,0 +1,3 @@
+/* Both objects bring their own copy of these, each in a COMDAT group */
+template<class T> T twice(T x) { return x * 2; }
+inline int counted(int x) { static int count; count = count + 1; return x + count; }
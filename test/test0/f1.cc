@@ -0,0 +1,2 @@
+#include "comdat.h"
+int f1() { return twice(3) + counted(1); }
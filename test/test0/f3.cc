@@ -0,0 +1,2 @@
+#include "comdat.h"
+int f3() { return twice(5) + counted(2); }
@@ -0,0 +1,45 @@
+#!/bin/sh
+## Copyright (C) 2020 Jeremiah Orians
+## This file is part of M3-Meteoroid.
+##
+## M3-Meteoroid is free software: you can redistribute it and/or modify
+## it under the terms of the GNU General Public License as published by
+## the Free Software Foundation, either version 3 of the License, or
+## (at your option) any later version.
+##
+## M3-Meteoroid is distributed in the hope that it will be useful,
+## but WITHOUT ANY WARRANTY; without even the implied warranty of
+## MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+## GNU General Public License for more details.
+##
+## You should have received a copy of the GNU General Public License
+## along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
+
+# Objects that share COMDAT groups have to link together, directly and as
+# relocatable outputs, with one copy of the template and of the static
+# local. The default unwind tables are kept, so the losing copies have
+# .eh_frame entries that point into the sections that were dropped.
+
+set -ex
+CXX=${CXX:-g++}
+CXXFLAGS="-m32 -O0 -fno-pic"
+
+$CXX $CXXFLAGS -c test/test0/f1.cc -o test/results/test0-f1.o
+$CXX $CXXFLAGS -c test/test0/f3.cc -o test/results/test0-f3.o
+$CXX $CXXFLAGS -c test/test0/start.cc -o test/results/test0-start.o
+
+./bin/M3-Meteoroid-x86 -f test/results/test0-start.o -f test/results/test0-f1.o -f test/results/test0-f3.o -o test/results/test0-direct
+./bin/M3-Meteoroid-x86 -r -f test/results/test0-f1.o -f test/results/test0-f3.o -o test/results/test0-r13.o
+./bin/M3-Meteoroid-x86 -f test/results/test0-start.o -f test/results/test0-r13.o -o test/results/test0-combined
+./bin/M3-Meteoroid-x86 -r -f test/results/test0-f1.o -o test/results/test0-r1.o
+./bin/M3-Meteoroid-x86 -r -f test/results/test0-f3.o -o test/results/test0-r3.o
+./bin/M3-Meteoroid-x86 -f test/results/test0-start.o -f test/results/test0-r1.o -f test/results/test0-r3.o -o test/results/test0-binary
+
+# f1 is 6 + 2 and f3 is 10 + 4, but only if counted shares one count
+set +e
+for binary in test0-direct test0-combined test0-binary
+do
+	./test/results/$binary
+	r=$?
+	[ 22 = $r ] || { rm -f test/results/test0-binary; exit 1; }
+done
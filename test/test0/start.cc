@@ -0,0 +1,8 @@
+int f1();
+int f3();
+extern "C" void _start()
+{
+	int r = f1() + f3();
+	asm volatile("int $0x80" :: "a"(1), "b"(r));
+	for(;;);
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+## Copyright (C) 2020 Jeremiah Orians
+## This file is part of M3-Meteoroid.
+##
+## M3-Meteoroid is free software: you can redistribute it and/or modify
+## it under the terms of the GNU General Public License as published by
+## the Free Software Foundation, either version 3 of the License, or
+## (at your option) any later version.
+##
+## M3-Meteoroid is distributed in the hope that it will be useful,
+## but WITHOUT ANY WARRANTY; without even the implied warranty of
+## MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+## GNU General Public License for more details.
+##
+## You should have received a copy of the GNU General Public License
+## along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
+
+# An object with more sections than fit in e_shnum, so the section count,
+# the section name table and the symbols past SHN_LORESERVE all have to be
+# found through extended section numbering.
+
+set -ex
+CC=${CC:-gcc}
+CFLAGS="-m32 -O1 -fno-pic -fno-asynchronous-unwind-tables"
+
+mkdir -p test/results/test1
+./bin/M3-Meteoroid-corpus --files 1 --functions 33000 --data 1 --calls 0 --loads 1 --function-sections --output test/results/test1
+$CC $CFLAGS -c test/test1/start.c -o test/results/test1-start.o
+./bin/M3-Meteoroid-x86 -f test/results/test1-start.o -f test/results/test1/obj0.o -o test/results/test1-binary
+
+set +e
+./test/results/test1-binary
+r=$?
+set -e
+[ 42 = $r ] || { rm test/results/test1-binary; exit 1; }
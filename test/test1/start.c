@@ -0,0 +1,20 @@
+/* The corpus generator's obj0.o has a section per function, with
+ * --calls 0 --loads 1 --data 1 each one is mov eax, [d_0_0] and ret */
+int f_0_0();
+int f_0_32999();
+extern int d_0_0;
+
+void _start()
+{
+	int r = 42;
+
+	/* f_0_32999 is in section 66003, named through SHN_XINDEX */
+	if(32999 * 6 != (char*)f_0_32999 - (char*)f_0_0) r = 1;
+
+	/* Its load has to reach the one data word */
+	d_0_0 = 7;
+	if(7 != f_0_32999()) r = 2;
+
+	asm volatile("int $0x80" :: "a"(1), "b"(r));
+	for(;;);
+}
@@ -0,0 +1,36 @@
+#!/bin/sh
+## Copyright (C) 2020 Jeremiah Orians
+## This file is part of M3-Meteoroid.
+##
+## M3-Meteoroid is free software: you can redistribute it and/or modify
+## it under the terms of the GNU General Public License as published by
+## the Free Software Foundation, either version 3 of the License, or
+## (at your option) any later version.
+##
+## M3-Meteoroid is distributed in the hope that it will be useful,
+## but WITHOUT ANY WARRANTY; without even the implied warranty of
+## MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+## GNU General Public License for more details.
+##
+## You should have received a copy of the GNU General Public License
+## along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
+
+# A relocatable link keeps every COMDAT member and its .group, so 33000
+# groups write more sections than fit in e_shnum and the output has to use
+# extended section numbering and .symtab_shndx itself.
+
+set -ex
+CC=${CC:-gcc}
+CFLAGS="-m32 -O1 -fno-pic -fno-asynchronous-unwind-tables"
+
+awk 'BEGIN { for(i = 0; i < 33000; i = i + 1) printf ".section .text.f%d,\"axG\",@progbits,f%d,comdat\n.globl f%d\nf%d:\n\tmovl $%d, %%eax\n\tret\n", i, i, i, i, i }' > test/results/test2-groups.s
+$CC -m32 -c test/results/test2-groups.s -o test/results/test2-groups.o
+$CC $CFLAGS -c test/test2/start.c -o test/results/test2-start.o
+./bin/M3-Meteoroid-x86 -r -f test/results/test2-groups.o -o test/results/test2-r.o
+./bin/M3-Meteoroid-x86 -f test/results/test2-start.o -f test/results/test2-r.o -f test/results/test2-groups.o -o test/results/test2-binary
+
+set +e
+./test/results/test2-binary
+r=$?
+set -e
+[ 42 = $r ] || { rm test/results/test2-binary; exit 1; }
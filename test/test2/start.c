@@ -0,0 +1,16 @@
+int f0();
+int f32999();
+
+void _start()
+{
+	int r = 42;
+
+	/* Both come from the relocatable output, the later copies in the original are dropped */
+	if(0 != f0()) r = 1;
+
+	/* Its section and group are past SHN_LORESERVE, named through SHN_XINDEX */
+	if(32999 != f32999()) r = 2;
+
+	asm volatile("int $0x80" :: "a"(1), "b"(r));
+	for(;;);
+}
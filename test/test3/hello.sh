@@ -0,0 +1,30 @@
+#!/bin/sh
+## Copyright (C) 2020 Jeremiah Orians
+## This file is part of M3-Meteoroid.
+##
+## M3-Meteoroid is free software: you can redistribute it and/or modify
+## it under the terms of the GNU General Public License as published by
+## the Free Software Foundation, either version 3 of the License, or
+## (at your option) any later version.
+##
+## M3-Meteoroid is distributed in the hope that it will be useful,
+## but WITHOUT ANY WARRANTY; without even the implied warranty of
+## MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+## GNU General Public License for more details.
+##
+## You should have received a copy of the GNU General Public License
+## along with M3-Meteoroid.  If not, see <http://www.gnu.org/licenses/>.
+
+# foo@GOT and bar@GOT without a base register, kept as GOT loads
+
+set -ex
+CC=${CC:-gcc}
+
+$CC -m32 -c test/test3/start.s -o test/results/test3-start.o
+./bin/M3-Meteoroid-x86 -f test/results/test3-start.o -o test/results/test3-binary
+
+set +e
+./test/results/test3-binary
+r=$?
+set -e
+[ 42 = $r ] || { rm test/results/test3-binary; exit 1; }
@@ -0,0 +1,25 @@
+# GOT loads with no base register are left alone by relaxation, so their
+# field has to hold the GOT entry's own address rather than its offset
+
+	.data
+	.globl foo
+foo:
+	.long 40
+bar:
+	.long 2
+
+	.text
+	.globl _start
+_start:
+	# R_386_GOT32X, add is not one of the instructions that relax
+	xorl %ecx, %ecx
+	addl foo@GOT, %ecx
+	movl (%ecx), %ebx
+
+	# R_386_GOT32, which never relaxes
+	pushl bar@GOT
+	popl %ecx
+	addl (%ecx), %ebx
+
+	movl $1, %eax
+	int $0x80
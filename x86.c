@@ -18,8 +18,29 @@
 #include "Meteoroid.h"
 
 void read_elf_file(struct segment* in);
-SCM get_address_from_symbol(char* name);
-void write_word(struct segment* f, int o);
+SCM read_word(struct segment* f, char* failure);
+struct segment* output_buffer_generate(SCM size);
+struct output_section* new_output_section(char* name, int type, SCM flags);
+struct symbol* find_global_symbol(char* name);
+void publish_symbol(struct symbol* s);
+SCM find_symbol_address(struct elf_object_file* f, struct elf_symbol* sym);
+void write_half(struct segment* f, int o);
+void write_word(struct segment* f, SCM o);
+void put_char(int c, struct segment* f);
+void print_byte(int c, FILE* f);
+struct relocation* group_relocations(struct relocation* head);
+
+/* Relocation handlers indexed by r_type */
+struct relocation_type** relocation_types;
+
+// CONSTANT MAX_NOP 9
+#define MAX_NOP 9
+/* MAX_NOP bytes for each NOP length */
+char* nop_table;
+
+/* Sizing of .got while objects are relaxed */
+int got_needed;
+SCM got_count;
 
 void architecture_load(struct segment* in)
 {
@@ -45,16 +66,451 @@ SCM Get_base_address()
 	return 0x8048000;
 }
 
+int nop_hex(int c)
+{
+	if(('0' <= c) && ('9' >= c)) return c - '0';
+	return c - 'A' + 10;
+}
+
+void add_nop(int length, char* hex)
+{
+	int i;
+	for(i = 0; i < length; i = i + 1)
+	{
+		nop_table[(length - 1) * MAX_NOP + i] = (nop_hex(hex[2 * i]) << 4) + nop_hex(hex[2 * i + 1]);
+	}
+}
+
+void setup_nops()
+{
+	/* The single instruction NOP forms recommended for every P6 and later core */
+	nop_table = calloc(MAX_NOP * MAX_NOP, sizeof(char));
+	add_nop(1, "90");
+	add_nop(2, "6690");
+	add_nop(3, "0F1F00");
+	add_nop(4, "0F1F4000");
+	add_nop(5, "0F1F440000");
+	add_nop(6, "660F1F440000");
+	add_nop(7, "0F1F8000000000");
+	add_nop(8, "0F1F840000000000");
+	add_nop(9, "660F1F840000000000");
+}
+
+void fill_code_gap(struct segment* f, SCM offset, SCM size)
+{
+	if(NULL == nop_table) setup_nops();
+
+	/* As few instructions as possible, so falling through the gap is cheap */
+	int length;
+	int i;
+	write_offset = offset;
+	while(0 < size)
+	{
+		length = MAX_NOP;
+		if(size < length) length = size;
+		for(i = 0; i < length; i = i + 1)
+		{
+			put_char(nop_table[(length - 1) * MAX_NOP + i], f);
+		}
+		size = size - length;
+	}
+}
+
+void add_relocation_type(SCM type, char* name, int size, int pc_relative)
+{
+	struct relocation_type* r = calloc(1, sizeof(struct relocation_type));
+	r->name = name;
+	r->type = type;
+	r->size = size;
+	r->pc_relative = pc_relative;
+	relocation_types[type] = r;
+}
+
+void add_got_relocation_type(SCM type, char* name, int pc_relative, int got)
+{
+	/* got is 1 for offsets from the GOT and 2 for the offset of a GOT entry */
+	add_relocation_type(type, name, 4, pc_relative);
+	relocation_types[type]->got = got;
+}
+
+void setup_relocation_types()
+{
+	relocation_types = calloc(256, sizeof(struct relocation_type*));
+	add_relocation_type(0, "R_386_NONE", 0, FALSE);
+	add_relocation_type(1, "R_386_32", 4, FALSE);
+	add_relocation_type(2, "R_386_PC32", 4, TRUE);
+	/* In a static link there is no PLT, so calls go straight to the symbol */
+	add_relocation_type(4, "R_386_PLT32", 4, TRUE);
+	add_relocation_type(20, "R_386_16", 2, FALSE);
+	add_relocation_type(21, "R_386_PC16", 2, TRUE);
+	add_relocation_type(22, "R_386_8", 1, FALSE);
+	add_relocation_type(23, "R_386_PC8", 1, TRUE);
+	add_got_relocation_type(3, "R_386_GOT32", FALSE, 2);
+	add_got_relocation_type(9, "R_386_GOTOFF", FALSE, 1);
+	/* _GLOBAL_OFFSET_TABLE_ is an ordinary symbol at the start of .got */
+	add_got_relocation_type(10, "R_386_GOTPC", TRUE, 0);
+	add_got_relocation_type(43, "R_386_GOT32X", FALSE, 2);
+}
+
+struct relocation_type* lookup_relocation_type(SCM type)
+{
+	if(NULL == relocation_types) setup_relocation_types();
+
+	struct relocation_type* r = NULL;
+	if((0 <= type) && (256 > type)) r = relocation_types[type];
+	if(NULL == r)
+	{
+		file_print("Unsupported x86 relocation type: 0x", stderr);
+		print_byte(type, stderr);
+		file_print("\nAborting before I do something stupid\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	return r;
+}
+
+int got_without_base(struct segment* c, SCM offset)
+{
+	/* A ModRM of mod 00 and r/m 101 in front of the field is a bare disp32 */
+	if(1 > offset) return FALSE;
+	return 0x05 == (c->contents[offset - 1] & 0xC7);
+}
+
+SCM relocation_value(struct relocation* r, struct relocation_type* handler)
+{
+	/* A relocatable output only keeps the addend, from the symbol the relocation now names */
+	if(Relocatable) return r->symbol_address + r->addend;
+
+	SCM value = r->symbol_address + r->addend;
+	if(2 == handler->got)
+	{
+		/* Without a base register to add the GOT to, the field is the entry's own address */
+		value = r->got_offset + r->addend;
+		if(got_without_base(r->target_section->contents, r->target_offset)) value = value + global_offset_table->address;
+	}
+	else if(1 == handler->got) value = value - global_offset_table->address;
+	if(handler->pc_relative) value = value - (r->target_section->contents->starting_address + r->target_offset);
+	return value;
+}
+
+void emit_relocation(struct relocation* r)
+{
+	/* Nothing to write into until the output exists */
+	struct output_section* o = r->target_section->output->relocations;
+	if(NULL == o) return;
+
+	/* The final address and the output symbol it was resolved against */
+	SCM symbol = 0;
+	if(NULL != r->output_symbol) symbol = r->output_symbol->symtab_index;
+	SCM offset = r->target_section->contents->starting_address + r->target_offset;
+	if(Relocatable) offset = offset - r->target_section->output->address;
+	write_offset = o->relocation_count * 8;
+	write_word(o->contents, offset);
+	write_word(o->contents, (symbol << 8) + r->type);
+	o->relocation_count = o->relocation_count + 1;
+}
+
+struct relocation* apply_relocation_group(struct relocation* r)
+{
+	/* Every relocation in a group shares its target section and type */
+	struct elf_section_header* target = r->target_section;
+	SCM type = r->type;
+	struct relocation_type* handler = lookup_relocation_type(type);
+	struct segment* contents = target->contents;
+
+	if(4 == handler->size)
+	{
+		while((NULL != r) && (target == r->target_section) && (type == r->type))
+		{
+			require(r->target_offset + 4 <= contents->size, "Relocation offset is outside of its section\n");
+			write_offset = r->target_offset;
+			write_word(contents, relocation_value(r, handler));
+			if(EmitRelocs) emit_relocation(r);
+			r = r->next;
+		}
+	}
+	else if(2 == handler->size)
+	{
+		while((NULL != r) && (target == r->target_section) && (type == r->type))
+		{
+			require(r->target_offset + 2 <= contents->size, "Relocation offset is outside of its section\n");
+			write_offset = r->target_offset;
+			write_half(contents, relocation_value(r, handler));
+			if(EmitRelocs) emit_relocation(r);
+			r = r->next;
+		}
+	}
+	else if(1 == handler->size)
+	{
+		while((NULL != r) && (target == r->target_section) && (type == r->type))
+		{
+			require(r->target_offset + 1 <= contents->size, "Relocation offset is outside of its section\n");
+			write_offset = r->target_offset;
+			put_char(relocation_value(r, handler) & 0xFF, contents);
+			if(EmitRelocs) emit_relocation(r);
+			r = r->next;
+		}
+	}
+	else
+	{
+		/* Nothing to write, just skip past the group */
+		while((NULL != r) && (target == r->target_section) && (type == r->type))
+		{
+			if(EmitRelocs) emit_relocation(r);
+			r = r->next;
+		}
+	}
+
+	return r;
+}
+
+int relax_got_instruction(struct segment* c, SCM offset)
+{
+	/* Rewrites the instruction in front of a GOT32X field that can skip the GOT:
+	 * 1 for lea, 2 for mov $imm, 3 for a direct call and 4 for a direct jmp; 0 if it has to stay */
+	if((2 > offset) || (offset + 4 > c->size)) return 0;
+
+	int opcode = c->contents[offset - 2] & 0xFF;
+	int modrm = c->contents[offset - 1] & 0xFF;
+	int mod = modrm >> 6;
+	int reg = (modrm >> 3) & 7;
+	int rm = modrm & 7;
+	int based = (2 == mod) && (4 != rm);
+	int absolute = got_without_base(c, offset);
+
+	if(0x8B == opcode)
+	{
+		/* mov foo@GOT(%base), %reg becomes lea foo@GOTOFF(%base), %reg */
+		if(based)
+		{
+			c->contents[offset - 2] = 0x8D;
+			return 1;
+		}
+
+		/* mov foo@GOT, %reg becomes mov $foo, %reg */
+		if(absolute)
+		{
+			c->contents[offset - 2] = 0xC7;
+			c->contents[offset - 1] = 0xC0 | reg;
+			return 2;
+		}
+	}
+	else if((0xFF == opcode) && (based || absolute))
+	{
+		/* call *foo@GOT(%base) becomes addr32 call foo, keeping the length */
+		if(2 == reg)
+		{
+			c->contents[offset - 2] = 0x67;
+			c->contents[offset - 1] = 0xE8;
+			return 3;
+		}
+
+		/* jmp *foo@GOT(%base) becomes jmp foo; nop */
+		if(4 == reg)
+		{
+			c->contents[offset - 2] = 0xE9;
+			c->contents[offset + 3] = 0x90;
+			return 4;
+		}
+	}
+	return 0;
+}
+
+SCM relaxed_got_type(int kind)
+{
+	if(1 == kind) return 9;
+	if(2 == kind) return 1;
+	return 2;
+}
+
+void relax_implicit_got_relocations(struct elf_section_header* s)
+{
+	struct elf_relocation* r;
+	int kind;
+	SCM addend;
+	for(r = s->r; NULL != r; r = r->next)
+	{
+		kind = 0;
+		if(43 == r->r_type)
+		{
+			/* Read before the jmp rewrite puts its nop over the last byte */
+			read_offset = r->r_offset;
+			addend = read_word(s->contents, "failed to read relocation addend from segment\n");
+			kind = relax_got_instruction(s->contents, r->r_offset);
+		}
+		if(0 != kind)
+		{
+			/* The displacement becomes a rel32 measured from the end of the instruction */
+			if(4 == kind) r->r_offset = r->r_offset - 1;
+			write_offset = r->r_offset;
+			if(3 <= kind) write_word(s->contents, addend - 4);
+			else write_word(s->contents, addend);
+			r->r_type = relaxed_got_type(kind);
+		}
+	}
+}
+
+void relax_explicit_got_relocations(struct elf_section_header* s)
+{
+	struct elf_adjusted_relocation* a;
+	int kind;
+	for(a = s->ar; NULL != a; a = a->next)
+	{
+		kind = 0;
+		if(43 == a->r_type) kind = relax_got_instruction(s->contents, a->r_offset);
+		if(0 != kind)
+		{
+			if(4 == kind) a->r_offset = a->r_offset - 1;
+			if(3 <= kind) a->r_addend = a->r_addend - 4;
+			a->r_type = relaxed_got_type(kind);
+		}
+	}
+}
+
+struct got_entry* find_got_entry(struct elf_object_file* f, struct elf_symbol* sym)
+{
+	/* Local symbols get an entry per file, everything else one per name */
+	int local = (0 == (sym->st_info >> 4));
+	struct got_entry* i;
+	for(i = got_entries; NULL != i; i = i->next)
+	{
+		if(local && (f == i->file) && (sym == i->symbol)) return i;
+		if(!local && (0 != (i->symbol->st_info >> 4)) && match(sym->st_name, i->symbol->st_name)) return i;
+	}
+	return NULL;
+}
+
+SCM got_entry_offset(struct elf_object_file* f, struct elf_symbol* sym)
+{
+	struct got_entry* r = find_got_entry(f, sym);
+	require(NULL != r, "GOT reference to a symbol without a GOT entry\n");
+	return r->offset;
+}
+
+SCM add_got_entry(struct elf_object_file* f, struct elf_symbol* sym, SCM count)
+{
+	if(NULL != find_got_entry(f, sym)) return count;
+
+	struct got_entry* r = calloc(1, sizeof(struct got_entry));
+	r->file = f;
+	r->symbol = sym;
+	r->offset = count * 4;
+	r->next = got_entries;
+	got_entries = r;
+	return count + 1;
+}
+
+int uses_got(SCM type)
+{
+	return (3 == type) || (9 == type) || (10 == type) || (43 == type);
+}
+
+void create_global_offset_table()
+{
+	if(!got_needed || (NULL != global_offset_table)) return;
+
+	/* SHT_PROGBITS with SHF_ALLOC + SHF_WRITE, a single piece holding every entry */
+	struct elf_section_header* piece = calloc(1, sizeof(struct elf_section_header));
+	piece->sh_name = ".got";
+	piece->sh_type = 1;
+	piece->sh_flags = 3;
+	piece->sh_addralign = 4;
+	piece->sh_size = got_count * 4;
+	piece->contents = output_buffer_generate(piece->sh_size);
+	piece->contents->name = ".got";
+
+	global_offset_table = new_output_section(".got", 1, 3);
+	global_offset_table->alignment = 4;
+	global_offset_table->pieces = piece;
+	global_offset_table->last_piece = piece;
+	piece->output = global_offset_table;
+}
+
+void relax_object_relocations(struct elf_object_file* f)
+{
+	/* Everything is defined in a static link, so most GOT loads can address the symbol directly.
+	 * The result only depends on the object, so a second pass over it makes the same choices */
+	struct elf_section_header* s;
+	struct elf_relocation* r;
+	struct elf_adjusted_relocation* a;
+	for(s = f->sections; NULL != s; s = s->next)
+	{
+		if(NULL != s->output)
+		{
+			relax_implicit_got_relocations(s);
+			relax_explicit_got_relocations(s);
+
+			/* Whatever is left still needs its GOT entry */
+			for(r = s->r; NULL != r; r = r->next)
+			{
+				if(uses_got(r->r_type)) got_needed = TRUE;
+				if(2 == lookup_relocation_type(r->r_type)->got) got_count = add_got_entry(f, r->symbol, got_count);
+			}
+			for(a = s->ar; NULL != a; a = a->next)
+			{
+				if(uses_got(a->r_type)) got_needed = TRUE;
+				if(2 == lookup_relocation_type(a->r_type)->got) got_count = add_got_entry(f, a->symbol, got_count);
+			}
+		}
+	}
+}
+
+struct symbol* add_linker_symbols(struct symbol* table)
+{
+	if(NULL == global_offset_table) return table;
+	if(NULL != find_global_symbol("_GLOBAL_OFFSET_TABLE_")) return table;
+
+	/* STB_GLOBAL and STT_OBJECT, so relocations from any file can find it */
+	struct symbol* r = calloc(1, sizeof(struct symbol));
+	r->name = "_GLOBAL_OFFSET_TABLE_";
+	r->address = global_offset_table->address;
+	r->info = 0x11;
+	r->section = ".got";
+	r->output = global_offset_table;
+	r->next = table;
+	publish_symbol(r);
+	return r;
+}
+
+void fill_global_offset_table()
+{
+	/* Entries hold the final address of their symbol, there is no dynamic linker to do it */
+	if(NULL == global_offset_table) return;
+
+	struct segment* contents = global_offset_table->pieces->contents;
+	struct got_entry* i;
+	for(i = got_entries; NULL != i; i = i->next)
+	{
+		write_offset = i->offset;
+		write_word(contents, find_symbol_address(i->file, i->symbol));
+	}
+}
+
 void apply_relocations()
 {
+	relocation_table = group_relocations(relocation_table);
 	struct relocation* r = relocation_table;
-	SCM offset;
 
 	while(NULL != r)
 	{
-		write_offset = r->target_offset;
-		offset = get_address_from_symbol(r->symbol_name);
-		write_word(r->target_section->contents, offset);
+		r = apply_relocation_group(r);
+	}
+}
+
+void patch_relocations(struct relocation* r, struct segment* debug)
+{
+	/* Sections that only exist in the output file are patched where they are mapped */
+	struct relocation_type* handler;
+	SCM value;
+
+	while(NULL != r)
+	{
+		handler = lookup_relocation_type(r->type);
+		value = relocation_value(r, handler);
+		require(r->target_offset + handler->size <= r->target_section->contents->size, "Relocation offset is outside of its section\n");
+		write_offset = r->target_section->output->offset + r->target_section->contents->starting_address + r->target_offset - debug->starting_address;
+		if(4 == handler->size) write_word(debug, value);
+		else if(2 == handler->size) write_half(debug, value);
+		else if(1 == handler->size) put_char(value & 0xFF, debug);
 		r = r->next;
 	}
 }